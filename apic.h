@@ -0,0 +1,88 @@
+#ifndef APIC_H
+#define APIC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "pmm.h"
+#include "x86.h"
+
+// Local APIC of the boot CPU, used for its timer (see timer.h).
+// Device interrupts still come from the 8259 PICs through LINT0 in
+// virtual wire mode. The registers are MMIO at the address in
+// IA32_APIC_BASE, mapped uncached into the MMIO window by init_lapic().
+
+#define MSR_APIC_BASE             0x1B
+#define MSR_TSC_DEADLINE          0x6E0
+#define APIC_BASE_ENABLE          (1 << 11)
+#define APIC_BASE_ADDR_MASK       0xFFFFF000
+
+#define LAPIC_TPR                 0x080
+#define LAPIC_EOI                 0x0B0
+#define LAPIC_SVR                 0x0F0
+#define LAPIC_LVT_TIMER           0x320
+#define LAPIC_LVT_LINT0           0x350
+#define LAPIC_LVT_LINT1           0x360
+#define LAPIC_TIMER_INITIAL       0x380
+#define LAPIC_TIMER_CURRENT       0x390
+#define LAPIC_TIMER_DIVIDE        0x3E0
+
+#define LAPIC_SVR_ENABLE          (1 << 8)
+#define LAPIC_LVT_MASKED          (1 << 16)
+#define LAPIC_LVT_EXTINT          (7 << 8)
+#define LAPIC_LVT_NMI             (4 << 8)
+#define LAPIC_TIMER_ONESHOT       (0 << 17)
+#define LAPIC_TIMER_TSC_DEADLINE  (2 << 17)
+#define LAPIC_DIVIDE_16           0x3
+
+#define LAPIC_TIMER_VECTOR        0x30   // Clear of the PIC's 0x20-0x2F
+#define LAPIC_SPURIOUS_VECTOR     0xFF   // Low nibble must be all ones on older APICs
+
+static volatile uint32_t *lapic = NULL;   // Registers, NULL without a local APIC
+static bool lapic_tsc_deadline = false;   // Timer supports TSC-deadline mode
+
+extern void *map_mmio(uint32_t phys, uint32_t size);
+extern void set_idt_entry(int vector, void (*handler)());
+extern void lapic_timer_entry();     // asm.s
+extern void lapic_spurious_entry();  // asm.s
+
+static inline uint32_t lapic_read(uint32_t reg) {
+    return lapic[reg / 4];
+}
+
+static inline void lapic_write(uint32_t reg, uint32_t value) {
+    lapic[reg / 4] = value;
+}
+
+static inline void lapic_eoi() {
+    lapic_write(LAPIC_EOI, 0);
+}
+
+// Map and enable the local APIC with its timer masked. Returns false if
+// the CPU has none, and everything keeps going through the PICs.
+bool init_lapic() {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &ebx, &ecx, &edx, &eax);
+    if (!(edx & CPUID_EDX_APIC)) return false;
+    lapic_tsc_deadline = (ecx & CPUID_ECX_TSC_DEADLINE) != 0;
+
+    uint64_t base = rdmsr(MSR_APIC_BASE);
+    lapic = map_mmio((uint32_t)base & APIC_BASE_ADDR_MASK, PAGE_SIZE);
+    if (lapic == NULL) return false;
+    wrmsr(MSR_APIC_BASE, base | APIC_BASE_ENABLE);
+
+    set_idt_entry(LAPIC_TIMER_VECTOR, lapic_timer_entry);
+    set_idt_entry(LAPIC_SPURIOUS_VECTOR, lapic_spurious_entry);
+
+    // Virtual wire mode: PIC interrupts arrive on LINT0, NMIs on LINT1
+    lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
+    lapic_write(LAPIC_LVT_LINT0, LAPIC_LVT_EXTINT);
+    lapic_write(LAPIC_LVT_LINT1, LAPIC_LVT_NMI);
+    lapic_write(LAPIC_TPR, 0);
+
+    lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_DIVIDE_16);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED | LAPIC_TIMER_ONESHOT | LAPIC_TIMER_VECTOR);
+    lapic_write(LAPIC_TIMER_INITIAL, 0);
+    return true;
+}
+
+#endif
@@ -1,35 +1,68 @@
 .intel_syntax noprefix
-#.globl swtch
+
+# void swtch(uint32_t *old_sp, uint32_t new_sp)
+# Voluntary context switch. Only the callee-saved registers are kept, the
+# C caller already treats eax, ecx and edx as clobbered.
+.globl swtch
 swtch:
   mov eax,[esp+4]
   mov edx,[esp+8]
-  #movl 4(%esp), %eax
-  #movl 8(%esp), %edx
 
   # Save old callee-save registers
-  #pushl %ebp
-  #pushl %ebx
-  #pushl %esi
-  #pushl %edi
   push ebp
   push ebx
   push esi
   push edi
 
   # Switch stacks
-  #movl %esp, (%eax)
-  #movl %edx, %esp
   mov [eax], esp
   mov esp, edx
 
   # Load new callee-save registers
-  #popl %edi
-  #popl %esi
-  #popl %ebx
-  #popl %ebp
   pop edi
   pop esi
   pop ebx
   pop ebp
   ret
-  
\ No newline at end of file
+
+# Interrupt entry. Every stub pushes an error code (0 when the CPU does
+# not) and its vector so all trap frames share one layout (trap_frame_t),
+# then the registers are saved and trap_dispatch() gets the frame. Tasks
+# are switched inside trap_dispatch() with swtch, so whichever task comes
+# back out here is resumed by the same popa/iret.
+.globl irq0_entry
+irq0_entry:
+  push 0
+  push 0x20
+  jmp trap_common
+
+.globl lapic_timer_entry
+lapic_timer_entry:
+  push 0
+  push 0x30                        # LAPIC_TIMER_VECTOR
+  jmp trap_common
+
+trap_common:
+  pushad
+  cld
+  push esp
+  call trap_dispatch
+  add esp, 4
+
+.globl trap_return
+trap_return:
+  popad
+  add esp, 8
+  iretd
+
+# Spurious local APIC interrupts must not be acknowledged
+.globl lapic_spurious_entry
+lapic_spurious_entry:
+  iretd
+
+# First swtch into a new task lands here, on top of the trap frame
+# create_process() built, and leaves through the common iret.
+.globl task_entry
+task_entry:
+  call sched_switch_done
+  jmp trap_return
@@ -2,6 +2,9 @@
 #define CPU_H
 #include <stddef.h>
 #include "memory.h"
+#include "slab.h"
+#include "list.h"
+#include "x86.h"
 
 struct interrupt_frame {
     unsigned int edi;       // General-purpose registers
@@ -23,6 +26,20 @@ struct interrupt_frame {
     unsigned int error_code; // Error code (optional, used by some exceptions)
 };
 
+// Saved by the assembly entry stubs in asm.s, lowest address first
+typedef struct trap_frame {
+    uint32_t edi, esi, ebp, esp, ebx, edx, ecx, eax;  // pushad, esp is ignored by popad
+    uint32_t vector;        // Pushed by the entry stub
+    uint32_t error_code;    // From the CPU, or 0 pushed by the stub
+    uint32_t eip;           // Pushed by the CPU, popped by iret
+    uint32_t cs;
+    uint32_t eflags;
+} trap_frame_t;
+
+#define KERNEL_CS       0x08
+#define EFLAGS_IF       0x200
+#define EFLAGS_RESERVED 0x002  // Always set
+
 typedef enum {
     RUNNING,
     READY,
@@ -30,165 +47,232 @@ typedef enum {
     TERMINATED
 } process_state_t;
 
+struct address_space;
+struct kstack;
+struct fpu_state;
+
 typedef struct process {
+    uint32_t pid;               // Unique while the process exists, see find_process()
     void (*func)();             // Pointer to the function to be executed
     process_state_t state;      // State of the process (RUNNING, READY, etc.)
-    unsigned int stack_pointer; // Pointer to the stack for this process
+    unsigned int stack_pointer; // Saved by swtch() while the process is switched out
     unsigned int stack_size;    // Size of the stack
-    struct process *next;       // Pointer to the next process in the list
+    struct kstack *stack;       // Pooled stack, see stack_alloc()
+    struct address_space *mm;   // Address space, NULL for the shared kernel one
+    struct fpu_state *fpu;      // Saved x87/SSE registers, allocated on first FP use
+    uint32_t priority;          // Current priority, 0 is most urgent (see sched.h)
+    uint32_t base_priority;     // Priority without any wakeup boost
+    uint32_t time_slice;        // Nanoseconds of its slice left, see sched.h
+    uint64_t slice_end;         // ktime_ns() the slice runs out at, set when it is switched in
+    uint64_t wake_time;         // ktime_ns() to wake up at while on the sleep queue
+    list_node_t run_node;       // Run queue membership while READY
+    list_node_t wait_node;      // Wait queue membership while blocked
+    list_node_t task_node;      // Membership of task_list, for the whole lifetime
+    list_node_t pid_node;       // Chain of its pid_hash bucket
 } process_t;
 
-process_t *ready_queue = NULL; // A linked list of processes in the READY state
+#define PID_HASH_SIZE 256  // Power of two
+
+list_node_t task_list;                 // Every process that exists, in creation order
+list_node_t pid_hash[PID_HASH_SIZE];   // Processes by pid & (PID_HASH_SIZE - 1)
+uint32_t next_pid = 1;                 // Next pid to try, 0 is never handed out
+uint32_t nr_tasks = 0;
+
 process_t *current_process = NULL; // The currently running process
+process_t *exited_process = NULL; // Terminated, its stack is released once we are off it
+kmem_cache_t *process_cache = NULL; // Slab cache backing every process_t
 
 unsigned int scheduler_stack[1024]; // A stack for the scheduler
-unsigned int scheduler_stack_pointer; // Pointer to the scheduler stack
+unsigned int scheduler_stack_pointer; // kmain's saved context while tasks run, see sched_start()
 
 extern void *malloc(size_t size);
 extern void printf(const char *format, ...);
 extern void free(void *ptr);
+extern struct kstack *stack_alloc(uint32_t size);
+extern void stack_free(struct kstack *stack);
+extern uint32_t kstack_top(struct kstack *stack);
+extern void switch_address_space(struct address_space *as);
+extern void fpu_switch_to(process_t *next);
+extern void fpu_release(struct fpu_state *state);
+extern struct address_space *address_space_clone(struct address_space *src);
+extern void address_space_release(struct address_space *as);
 extern void outb(uint16_t port, uint8_t value);
 extern void disable_interrupts();
 extern void enable_interrupts();
-
-void perform_context_switch(unsigned int* old_esp, unsigned int new_esp) {
-    __asm__ __volatile__ (
-        "pusha\n\t"
-        "mov %%esp, %0\n\t"         // Save current ESP to *old_esp
-        "mov %1, %%esp\n\t"         // Load new ESP
-        "popa\n\t"                  // Restore general-purpose registers
-        "iret\n\t"                  // Return from interrupt
-        : "=m" (*old_esp)           // Output constraint for saving old ESP
-        : "r" (new_esp)             // Input constraint for new ESP
-        : "memory"                  // Memory clobber
-    );
-
-    // This line will never execute due to `iret`
+extern void sched_init_task(process_t *process);
+extern void sched_enqueue(process_t *process);
+extern process_t *sched_pick_next();
+extern process_t *schedule();
+extern void sched_update_timer();
+extern void swtch(uint32_t *old_sp, uint32_t new_sp);  // asm.s
+extern void task_entry();                              // asm.s
+extern void irq0_entry();                              // asm.s
+
+static inline list_node_t *pid_bucket(uint32_t pid) {
+    return &pid_hash[pid & (PID_HASH_SIZE - 1)];
 }
 
-void swtch(process_t *old_process, process_t *new_process) {
-    asm volatile (
-        "pusha\n\t"                      // Save all general-purpose registers
-        "movl %%esp, %0\n\t"             // Save ESP to old_process->stack_pointer (if old_process is not NULL)
-        "movl %1, %%esp\n\t"             // Load ESP with new_process->stack_pointer
-        "popa\n\t"                       // Restore all general-purpose registers
-        "ret\n\t"                        // Return to the new process
-        : "=m"(old_process->stack_pointer)
-        : "m"(new_process->stack_pointer)
-        : "memory"
-    );
-}
-
-uint32_t *label_address;
-
-void terminate_process() {
-    // Mark the current process as TERMINATED
-    current_process->state = TERMINATED;
-
-    // Remove the current process from the ready queue
-    if (ready_queue == current_process) {
-        ready_queue = current_process->next;
-    } else {
-        process_t *prev = ready_queue;
-        while (prev && prev->next != current_process) {
-            prev = prev->next;
-        }
-        if (prev) {
-            prev->next = current_process->next;
-        }
+// Look a process up by pid, O(1) while the hash chains stay short
+process_t *find_process(uint32_t pid) {
+    if (process_cache == NULL) return NULL;
+    list_node_t *bucket = pid_bucket(pid);
+    list_for_each(node, bucket) {
+        process_t *process = list_entry(node, process_t, pid_node);
+        if (process->pid == pid) return process;
     }
+    return NULL;
+}
 
-    // Switch back to the scheduler
-    current_process = ready_queue;
-    if (current_process) {
-        swtch(NULL, current_process);
-    } else {
-        // No more processes to run, return to kmain
-        asm volatile ("jmp *%0" : : "r"(label_address));
+static uint32_t alloc_pid() {
+    for (;;) {
+        uint32_t pid = next_pid++;
+        if (pid == 0) continue;
+        if (find_process(pid) == NULL) return pid;
     }
 }
 
-void add_process(void (*func)(), unsigned int stack_size) {
-    process_t *new_process = (process_t*)malloc(sizeof(process_t));
-    if (new_process == NULL) return;
-
-    new_process->func = func;
-    new_process->state = READY;
-    new_process->stack_size = stack_size;
-    
-    // Allocate stack
-    void* stack_mem = malloc(stack_size);
-    if (stack_mem == NULL) {
-        free(new_process);
-        return;
+// Process control blocks come from their own slab cache, created on first use.
+// Every block gets a pid and is on task_list until free_process().
+process_t *alloc_process() {
+    if (process_cache == NULL) {
+        process_cache = kmem_cache_create("process_t", sizeof(process_t), 0, NULL);
+        if (process_cache == NULL) return NULL;
+        list_init(&task_list);
+        for (uint32_t i = 0; i < PID_HASH_SIZE; i++) list_init(&pid_hash[i]);
     }
+    process_t *process = (process_t *)kmem_cache_alloc(process_cache);
+    if (process == NULL) return NULL;
+
+    uint32_t flags = irq_save();
+    process->pid = alloc_pid();
+    list_init(&process->run_node);
+    list_init(&process->wait_node);
+    list_add_tail(&task_list, &process->task_node);
+    list_add_head(pid_bucket(process->pid), &process->pid_node);
+    nr_tasks++;
+    irq_restore(flags);
+    return process;
+}
 
-    // Point to top of stack (stack grows down)
-    unsigned int *stack = (unsigned int*)((unsigned int)stack_mem + stack_size);
-
-    // Set up initial interrupt frame
-    // *(--stack) = 0x202;               // EFLAGS with interrupts enabled
-    // *(--stack) = 0x08;                // CS - assuming this is your code segment
-    // *(--stack) = (unsigned int)func;   // EIP - starting point
+void free_process(process_t *process) {
+    uint32_t flags = irq_save();
+    if (list_linked(&process->wait_node)) list_remove(&process->wait_node);
+    list_remove(&process->task_node);
+    list_remove(&process->pid_node);
+    nr_tasks--;
+    irq_restore(flags);
+    kmem_cache_free(process_cache, process);
+}
 
-    // // Save initial registers
-    // *(--stack) = 0;    // EAX
-    // *(--stack) = 0;    // ECX
-    // *(--stack) = 0;    // EDX
-    // *(--stack) = 0;    // EBX
-    // *(--stack) = (unsigned int)stack_mem + stack_size;  // ESP
-    // *(--stack) = 0;    // EBP
-    // *(--stack) = 0;    // ESI
-    // *(--stack) = 0;    // EDI
+// A terminating process still runs on its own stack, so it is only
+// recycled here, from whatever runs next
+void reap_exited_process() {
+    if (exited_process == NULL) return;
+    stack_free(exited_process->stack);
+    fpu_release(exited_process->fpu);
+    free_process(exited_process);
+    exited_process = NULL;
+}
 
-    new_process->stack_pointer = (unsigned int)stack;
-    new_process->next = NULL;
-
-    // Add to ready queue
-    if (ready_queue == NULL) {
-        ready_queue = new_process;
-    } else {
-        process_t *last = ready_queue;
-        while (last->next != NULL) last = last->next;
-        last->next = new_process;
-    }
+// Runs on the dying task's own stack, which is only recycled once another
+// task (or kmain) has switched away from it
+void terminate_process() {
+    // Interrupts stay off until whatever runs next restores its own flags,
+    // this task never resumes to turn them back on
+    disable_interrupts();
+    reap_exited_process();
+
+    // Mark the current process as TERMINATED, the running task is on no run queue
+    process_t *dead = current_process;
+    dead->state = TERMINATED;
+    exited_process = dead;
+
+    // Leave the address space before dropping it, the last user frees its pages
+    struct address_space *mm = dead->mm;
+    current_process = sched_pick_next();
+    switch_address_space(current_process ? current_process->mm : NULL);
+    address_space_release(mm);
+    fpu_switch_to(current_process);
+    sched_update_timer();
+
+    // Nothing runnable: back to kmain's idle loop in sched_start()
+    swtch(&dead->stack_pointer, current_process ? current_process->stack_pointer : scheduler_stack_pointer);
 }
 
 process_t * create_process(uint32_t pc, unsigned int stack_size)
 {
-    process_t *new_process = (process_t*)malloc(sizeof(process_t));
+    reap_exited_process();
+
+    process_t *new_process = alloc_process();
     if (new_process == NULL) return NULL;
 
-    // Allocate stack memory
-    void* stack_mem = malloc(stack_size);
-    unsigned int *stack = (unsigned int*)((unsigned int)stack_mem + stack_size);
+    // Allocate a pooled stack with a guard page below it
+    new_process->stack = stack_alloc(stack_size);
+    if (new_process->stack == NULL) {
+        free_process(new_process);
+        return NULL;
+    }
+    unsigned int *stack = (unsigned int*)kstack_top(new_process->stack);
 
-    // Push return address (termination handler)
-    *(--stack) = (unsigned int) terminate_process;  // Replace with an appropriate termination function
+    // Return address of the process function (termination handler)
+    *(--stack) = (unsigned int) terminate_process;
 
-    // Push EIP (function entry point)
+    // Trap frame the first run leaves through, as if the task had been interrupted at pc
+    *(--stack) = EFLAGS_IF | EFLAGS_RESERVED;
+    *(--stack) = KERNEL_CS;
     *(--stack) = pc;
+    *(--stack) = 0;    // Error code
+    *(--stack) = 0;    // Vector
+    for (int i = 0; i < 8; i++) {
+        *(--stack) = 0;    // EAX, ECX, EDX, EBX, ESP (ignored), EBP, ESI, EDI
+    }
 
-    // Push initial registers
-    *(--stack) = 0;    // EAX
-    *(--stack) = 0;    // ECX
-    *(--stack) = 0;    // EDX
-    *(--stack) = 0;    // EBX
-    *(--stack) = 0;    // ESP (will be overwritten)
+    // swtch() context: its ret goes to task_entry, which runs the iret path
+    *(--stack) = (unsigned int) task_entry;
     *(--stack) = 0;    // EBP
+    *(--stack) = 0;    // EBX
     *(--stack) = 0;    // ESI
     *(--stack) = 0;    // EDI
 
     // Set up the process struct
     new_process->stack_pointer = (unsigned int)stack;
-    new_process->next = NULL;
+    new_process->mm = NULL;
+    new_process->fpu = NULL;
     new_process->func = (void*)pc;
     new_process->state = READY;
     new_process->stack_size = stack_size;
+    sched_init_task(new_process);
 
     return new_process;
 }
 
+void add_process(void (*func)(), unsigned int stack_size) {
+    process_t *new_process = create_process((uint32_t)func, stack_size);
+    if (new_process == NULL) return;
+
+    uint32_t flags = irq_save();
+    sched_enqueue(new_process);
+    sched_update_timer();
+    irq_restore(flags);
+}
+
+// Clone a process: the child shares all of the parent's user pages copy-on-write,
+// so spawning near-identical workers costs page tables rather than memory.
+// Stacks live in the shared kernel half and are not cloned, the child starts
+// at pc on a stack of its own instead of returning twice.
+process_t *fork_process(process_t *parent, uint32_t pc, unsigned int stack_size) {
+    struct address_space *mm = address_space_clone(parent ? parent->mm : NULL);
+    if (mm == NULL) return NULL;
+
+    process_t *child = create_process(pc, stack_size);
+    if (child == NULL) {
+        address_space_release(mm);
+        return NULL;
+    }
+    child->mm = mm;
+    return child;
+}
+
 // void switch_context(struct interrupt_frame* frame) {
 //     if (current_process == NULL) {
 //         if (ready_queue != NULL) {
@@ -243,68 +327,4 @@ process_t * create_process(uint32_t pc, unsigned int stack_size)
 //     );
 // }
 
-
-void switch_context(struct interrupt_frame* frame) {
-    if (current_process == NULL) {
-        if (ready_queue != NULL) {
-            current_process = ready_queue;
-            ready_queue = ready_queue->next;
-            current_process->state = RUNNING;
-            current_process->next = NULL;
-
-            // Set the stack pointer for the new process
-            __asm__ __volatile__ (
-                "mov %0, %%esp\n\t"
-                "popa\n\t"
-                "iret\n\t"
-                : : "r" (current_process->stack_pointer)
-            );
-        }
-        return;
-    }
-
-    // Save the current process state
-    current_process->stack_pointer = (unsigned int)frame->esp;
-    current_process->state = READY;
-
-    // Move current process to end of ready queue
-    if (ready_queue == NULL) {
-        ready_queue = current_process;
-    } else {
-        process_t *last = ready_queue;
-        while (last->next != NULL) last = last->next;
-        last->next = current_process;
-    }
-    current_process->next = NULL;
-
-    // Get the next process from the ready queue
-    if (ready_queue != NULL) {
-        process_t *next = ready_queue;
-        ready_queue = ready_queue->next;
-        next->state = RUNNING;
-        next->next = NULL;
-
-        // Switch to the next process
-        process_t *old = current_process;
-        current_process = next;
-
-        // Perform the context switch by saving the old process' stack and loading the new one
-        disable_interrupts();
-        perform_context_switch(&old->stack_pointer, next->stack_pointer);
-        enable_interrupts();
-    }
-}
-
-// Helper function to print the state of the queue (add this for debugging)
-void print_queue_state() {
-    printf("Current process: %x\n", (unsigned int)current_process);
-    printf("Ready queue:\n");
-    process_t *temp = ready_queue;
-    while (temp != NULL) {
-        printf("  Process at %x (func: %x)\n", 
-               (unsigned int)temp, (unsigned int)temp->func);
-        temp = temp->next;
-    }
-}
-
 #endif
\ No newline at end of file
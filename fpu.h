@@ -0,0 +1,150 @@
+#ifndef FPU_H
+#define FPU_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "klib.h"
+#include "cpu.h"
+#include "x86.h"
+#include "slab.h"
+
+// x87/SSE state is switched lazily. A context switch only sets CR0.TS; the
+// first FP or SSE instruction afterwards raises #NM (vector 7), and only then
+// are the old owner's registers saved and the new task's loaded. Tasks that
+// never touch floating point cost nothing at switch time and never get a
+// save area. Kernel code outside any process uses kernel_fpu_state.
+
+#define CR0_MP          (1 << 1)   // WAIT/FWAIT honours TS
+#define CR0_EM          (1 << 2)   // No FPU, emulate (must be clear)
+#define CR0_TS          (1 << 3)   // Task switched, next FP use raises #NM
+#define CR0_NE          (1 << 5)   // Native x87 error reporting
+
+#define CR4_OSFXSR      (1 << 9)   // FXSAVE/FXRSTOR and SSE enabled
+#define CR4_OSXMMEXCPT  (1 << 10)  // Unmasked SSE exceptions raise #XM
+
+#define FPU_STATE_SIZE  512        // FXSAVE area, FNSAVE needs only 108
+
+typedef struct fpu_state {
+    uint8_t data[FPU_STATE_SIZE];
+} __attribute__((aligned(16))) fpu_state_t;
+
+static fpu_state_t fpu_initial_state;      // Clean registers right after FNINIT
+static fpu_state_t kernel_fpu_state;       // Used when no process is running
+static fpu_state_t *fpu_owner = NULL;      // Whose values are in the registers now
+static kmem_cache_t *fpu_state_cache = NULL;
+static bool fpu_has_fxsr = false;
+static uint32_t kernel_fpu_flags;          // EFLAGS saved by kernel_fpu_begin()
+
+static inline uint32_t read_cr0() {
+    uint32_t value;
+    __asm__ __volatile__("movl %%cr0, %0" : "=r"(value));
+    return value;
+}
+
+static inline void write_cr0(uint32_t value) {
+    __asm__ __volatile__("movl %0, %%cr0" : : "r"(value) : "memory");
+}
+
+static inline void clts() {
+    __asm__ __volatile__("clts");
+}
+
+static inline void stts() {
+    write_cr0(read_cr0() | CR0_TS);
+}
+
+static inline void fpu_save(fpu_state_t *state) {
+    if (fpu_has_fxsr) __asm__ __volatile__("fxsave (%0)" : : "r"(state) : "memory");
+    else __asm__ __volatile__("fnsave (%0)" : : "r"(state) : "memory");
+}
+
+static inline void fpu_restore(fpu_state_t *state) {
+    if (fpu_has_fxsr) __asm__ __volatile__("fxrstor (%0)" : : "r"(state) : "memory");
+    else __asm__ __volatile__("frstor (%0)" : : "r"(state) : "memory");
+}
+
+void setup_fpu() {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &ebx, &ecx, &edx, &eax);
+    fpu_has_fxsr = (edx & CPUID_EDX_FXSR) != 0;
+
+    write_cr0((read_cr0() & ~(CR0_EM | CR0_TS)) | CR0_MP | CR0_NE);
+    if (fpu_has_fxsr) write_cr4(read_cr4() | CR4_OSFXSR | CR4_OSXMMEXCPT);
+
+    __asm__ __volatile__("fninit");
+    fpu_save(&fpu_initial_state);
+    memcpy(&kernel_fpu_state, &fpu_initial_state, sizeof(fpu_state_t));
+
+    // Nobody owns the registers yet, the first FP instruction claims them
+    fpu_owner = NULL;
+    stts();
+}
+
+// Save area of whatever is running now, allocated on its first FP use
+static fpu_state_t *fpu_current_state() {
+    if (current_process == NULL) return &kernel_fpu_state;
+    if (current_process->fpu == NULL) {
+        if (fpu_state_cache == NULL) {
+            fpu_state_cache = kmem_cache_create("fpu_state_t", sizeof(fpu_state_t), 16, NULL);
+            if (fpu_state_cache == NULL) return NULL;
+        }
+        fpu_state_t *state = (fpu_state_t *)kmem_cache_alloc(fpu_state_cache);
+        if (state == NULL) return NULL;
+        memcpy(state, &fpu_initial_state, sizeof(fpu_state_t));
+        current_process->fpu = state;
+    }
+    return current_process->fpu;
+}
+
+// Called on every context switch, arms #NM unless `next` already owns the registers
+void fpu_switch_to(process_t *next) {
+    fpu_state_t *state = next ? next->fpu : &kernel_fpu_state;
+    if (state != NULL && state == fpu_owner) clts();
+    else stts();
+}
+
+// A dead process's save area goes back to the cache, its register values are dropped
+void fpu_release(fpu_state_t *state) {
+    if (state == NULL) return;
+    if (fpu_owner == state) fpu_owner = NULL;
+    kmem_cache_free(fpu_state_cache, state);
+}
+
+// Let kernel code use x87/SSE registers. The owner's values are saved first
+// and interrupts stay off until kernel_fpu_end() so no switch can interleave.
+// Calls do not nest.
+void kernel_fpu_begin() {
+    __asm__ __volatile__("pushfl; popl %0; cli" : "=r"(kernel_fpu_flags) : : "memory");
+    clts();
+    if (fpu_owner) {
+        fpu_save(fpu_owner);
+        fpu_owner = NULL;
+    }
+}
+
+void kernel_fpu_end() {
+    // The registers hold scratch values now, the next FP user reloads its own
+    stts();
+    __asm__ __volatile__("pushl %0; popfl" : : "r"(kernel_fpu_flags) : "memory", "cc");
+}
+
+#pragma GCC target("general-regs-only")
+__attribute__((interrupt)) void fpu_nm_handler(struct interrupt_frame* frame) {
+    clts();
+
+    fpu_state_t *state = fpu_current_state();
+    if (state == fpu_owner) return;
+    if (fpu_owner) fpu_save(fpu_owner);
+
+    if (state == NULL) {
+        // No memory for a save area, run on clean registers and stay unowned
+        fpu_restore(&fpu_initial_state);
+        fpu_owner = NULL;
+        return;
+    }
+    fpu_restore(state);
+    fpu_owner = state;
+}
+#pragma GCC reset_options
+
+#endif
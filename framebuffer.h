@@ -0,0 +1,316 @@
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "klib.h"
+#include "vga.h"
+#include "multiboot.h"
+#include "memory.h"
+
+// Glyph console on the linear framebuffer the loader set up for us.
+// Text is rendered into a back buffer in ordinary RAM, and only the
+// rectangle touched since the last flush is copied out to the framebuffer,
+// one scanline at a time with memcpy() so the copy uses the widest string
+// stores this CPU has. The back buffer is a ring of text rows, so scrolling
+// only clears the row that comes into view. fb_write() runs with interrupts
+// off and is cheap; the blit in fb_flush() is the slow part and runs with
+// them on. Without a 32 bpp RGB framebuffer the kernel stays on the 80x25
+// text console.
+
+#define FONT_WIDTH   8
+#define FONT_HEIGHT  8
+#define FONT_FIRST   0x20
+#define FONT_LAST    0x7E
+
+// Printable ASCII, one byte per scanline, bit 0 is the leftmost pixel
+static const uint8_t font8x8[FONT_LAST - FONT_FIRST + 1][FONT_HEIGHT] = {
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },  // ' '
+    { 0x18, 0x3C, 0x3C, 0x18, 0x18, 0x00, 0x18, 0x00 },  // '!'
+    { 0x36, 0x36, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },  // '"'
+    { 0x36, 0x36, 0x7F, 0x36, 0x7F, 0x36, 0x36, 0x00 },  // '#'
+    { 0x0C, 0x3E, 0x03, 0x1E, 0x30, 0x1F, 0x0C, 0x00 },  // '$'
+    { 0x00, 0x63, 0x33, 0x18, 0x0C, 0x66, 0x63, 0x00 },  // '%'
+    { 0x1C, 0x36, 0x1C, 0x6E, 0x3B, 0x33, 0x6E, 0x00 },  // '&'
+    { 0x06, 0x06, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00 },  // '''
+    { 0x18, 0x0C, 0x06, 0x06, 0x06, 0x0C, 0x18, 0x00 },  // '('
+    { 0x06, 0x0C, 0x18, 0x18, 0x18, 0x0C, 0x06, 0x00 },  // ')'
+    { 0x00, 0x66, 0x3C, 0xFF, 0x3C, 0x66, 0x00, 0x00 },  // '*'
+    { 0x00, 0x0C, 0x0C, 0x3F, 0x0C, 0x0C, 0x00, 0x00 },  // '+'
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x0C, 0x0C, 0x06 },  // ','
+    { 0x00, 0x00, 0x00, 0x3F, 0x00, 0x00, 0x00, 0x00 },  // '-'
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x0C, 0x0C, 0x00 },  // '.'
+    { 0x60, 0x30, 0x18, 0x0C, 0x06, 0x03, 0x01, 0x00 },  // '/'
+    { 0x3E, 0x63, 0x73, 0x7B, 0x6F, 0x67, 0x3E, 0x00 },  // '0'
+    { 0x0C, 0x0E, 0x0C, 0x0C, 0x0C, 0x0C, 0x3F, 0x00 },  // '1'
+    { 0x1E, 0x33, 0x30, 0x1C, 0x06, 0x33, 0x3F, 0x00 },  // '2'
+    { 0x1E, 0x33, 0x30, 0x1C, 0x30, 0x33, 0x1E, 0x00 },  // '3'
+    { 0x38, 0x3C, 0x36, 0x33, 0x7F, 0x30, 0x78, 0x00 },  // '4'
+    { 0x3F, 0x03, 0x1F, 0x30, 0x30, 0x33, 0x1E, 0x00 },  // '5'
+    { 0x1C, 0x06, 0x03, 0x1F, 0x33, 0x33, 0x1E, 0x00 },  // '6'
+    { 0x3F, 0x33, 0x30, 0x18, 0x0C, 0x0C, 0x0C, 0x00 },  // '7'
+    { 0x1E, 0x33, 0x33, 0x1E, 0x33, 0x33, 0x1E, 0x00 },  // '8'
+    { 0x1E, 0x33, 0x33, 0x3E, 0x30, 0x18, 0x0E, 0x00 },  // '9'
+    { 0x00, 0x0C, 0x0C, 0x00, 0x00, 0x0C, 0x0C, 0x00 },  // ':'
+    { 0x00, 0x0C, 0x0C, 0x00, 0x00, 0x0C, 0x0C, 0x06 },  // ';'
+    { 0x18, 0x0C, 0x06, 0x03, 0x06, 0x0C, 0x18, 0x00 },  // '<'
+    { 0x00, 0x00, 0x3F, 0x00, 0x00, 0x3F, 0x00, 0x00 },  // '='
+    { 0x06, 0x0C, 0x18, 0x30, 0x18, 0x0C, 0x06, 0x00 },  // '>'
+    { 0x1E, 0x33, 0x30, 0x18, 0x0C, 0x00, 0x0C, 0x00 },  // '?'
+    { 0x3E, 0x63, 0x7B, 0x7B, 0x7B, 0x03, 0x1E, 0x00 },  // '@'
+    { 0x0C, 0x1E, 0x33, 0x33, 0x3F, 0x33, 0x33, 0x00 },  // 'A'
+    { 0x3F, 0x66, 0x66, 0x3E, 0x66, 0x66, 0x3F, 0x00 },  // 'B'
+    { 0x3C, 0x66, 0x03, 0x03, 0x03, 0x66, 0x3C, 0x00 },  // 'C'
+    { 0x1F, 0x36, 0x66, 0x66, 0x66, 0x36, 0x1F, 0x00 },  // 'D'
+    { 0x7F, 0x46, 0x16, 0x1E, 0x16, 0x46, 0x7F, 0x00 },  // 'E'
+    { 0x7F, 0x46, 0x16, 0x1E, 0x16, 0x06, 0x0F, 0x00 },  // 'F'
+    { 0x3C, 0x66, 0x03, 0x03, 0x73, 0x66, 0x7C, 0x00 },  // 'G'
+    { 0x33, 0x33, 0x33, 0x3F, 0x33, 0x33, 0x33, 0x00 },  // 'H'
+    { 0x1E, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x1E, 0x00 },  // 'I'
+    { 0x78, 0x30, 0x30, 0x30, 0x33, 0x33, 0x1E, 0x00 },  // 'J'
+    { 0x67, 0x66, 0x36, 0x1E, 0x36, 0x66, 0x67, 0x00 },  // 'K'
+    { 0x0F, 0x06, 0x06, 0x06, 0x46, 0x66, 0x7F, 0x00 },  // 'L'
+    { 0x63, 0x77, 0x7F, 0x7F, 0x6B, 0x63, 0x63, 0x00 },  // 'M'
+    { 0x63, 0x67, 0x6F, 0x7B, 0x73, 0x63, 0x63, 0x00 },  // 'N'
+    { 0x1C, 0x36, 0x63, 0x63, 0x63, 0x36, 0x1C, 0x00 },  // 'O'
+    { 0x3F, 0x66, 0x66, 0x3E, 0x06, 0x06, 0x0F, 0x00 },  // 'P'
+    { 0x1E, 0x33, 0x33, 0x33, 0x3B, 0x1E, 0x38, 0x00 },  // 'Q'
+    { 0x3F, 0x66, 0x66, 0x3E, 0x36, 0x66, 0x67, 0x00 },  // 'R'
+    { 0x1E, 0x33, 0x07, 0x0E, 0x38, 0x33, 0x1E, 0x00 },  // 'S'
+    { 0x3F, 0x2D, 0x0C, 0x0C, 0x0C, 0x0C, 0x1E, 0x00 },  // 'T'
+    { 0x33, 0x33, 0x33, 0x33, 0x33, 0x33, 0x3F, 0x00 },  // 'U'
+    { 0x33, 0x33, 0x33, 0x33, 0x33, 0x1E, 0x0C, 0x00 },  // 'V'
+    { 0x63, 0x63, 0x63, 0x6B, 0x7F, 0x77, 0x63, 0x00 },  // 'W'
+    { 0x63, 0x63, 0x36, 0x1C, 0x1C, 0x36, 0x63, 0x00 },  // 'X'
+    { 0x33, 0x33, 0x33, 0x1E, 0x0C, 0x0C, 0x1E, 0x00 },  // 'Y'
+    { 0x7F, 0x63, 0x31, 0x18, 0x4C, 0x66, 0x7F, 0x00 },  // 'Z'
+    { 0x1E, 0x06, 0x06, 0x06, 0x06, 0x06, 0x1E, 0x00 },  // '['
+    { 0x03, 0x06, 0x0C, 0x18, 0x30, 0x60, 0x40, 0x00 },  // '\'
+    { 0x1E, 0x18, 0x18, 0x18, 0x18, 0x18, 0x1E, 0x00 },  // ']'
+    { 0x08, 0x1C, 0x36, 0x63, 0x00, 0x00, 0x00, 0x00 },  // '^'
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xFF },  // '_'
+    { 0x0C, 0x0C, 0x18, 0x00, 0x00, 0x00, 0x00, 0x00 },  // '`'
+    { 0x00, 0x00, 0x1E, 0x30, 0x3E, 0x33, 0x6E, 0x00 },  // 'a'
+    { 0x07, 0x06, 0x06, 0x3E, 0x66, 0x66, 0x3B, 0x00 },  // 'b'
+    { 0x00, 0x00, 0x1E, 0x33, 0x03, 0x33, 0x1E, 0x00 },  // 'c'
+    { 0x38, 0x30, 0x30, 0x3E, 0x33, 0x33, 0x6E, 0x00 },  // 'd'
+    { 0x00, 0x00, 0x1E, 0x33, 0x3F, 0x03, 0x1E, 0x00 },  // 'e'
+    { 0x1C, 0x36, 0x06, 0x0F, 0x06, 0x06, 0x0F, 0x00 },  // 'f'
+    { 0x00, 0x00, 0x6E, 0x33, 0x33, 0x3E, 0x30, 0x1F },  // 'g'
+    { 0x07, 0x06, 0x36, 0x6E, 0x66, 0x66, 0x67, 0x00 },  // 'h'
+    { 0x0C, 0x00, 0x0E, 0x0C, 0x0C, 0x0C, 0x1E, 0x00 },  // 'i'
+    { 0x30, 0x00, 0x30, 0x30, 0x30, 0x33, 0x33, 0x1E },  // 'j'
+    { 0x07, 0x06, 0x66, 0x36, 0x1E, 0x36, 0x67, 0x00 },  // 'k'
+    { 0x0E, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x1E, 0x00 },  // 'l'
+    { 0x00, 0x00, 0x33, 0x7F, 0x7F, 0x6B, 0x63, 0x00 },  // 'm'
+    { 0x00, 0x00, 0x1F, 0x33, 0x33, 0x33, 0x33, 0x00 },  // 'n'
+    { 0x00, 0x00, 0x1E, 0x33, 0x33, 0x33, 0x1E, 0x00 },  // 'o'
+    { 0x00, 0x00, 0x3B, 0x66, 0x66, 0x3E, 0x06, 0x0F },  // 'p'
+    { 0x00, 0x00, 0x6E, 0x33, 0x33, 0x3E, 0x30, 0x78 },  // 'q'
+    { 0x00, 0x00, 0x3B, 0x6E, 0x66, 0x06, 0x0F, 0x00 },  // 'r'
+    { 0x00, 0x00, 0x3E, 0x03, 0x1E, 0x30, 0x1F, 0x00 },  // 's'
+    { 0x08, 0x0C, 0x3E, 0x0C, 0x0C, 0x2C, 0x18, 0x00 },  // 't'
+    { 0x00, 0x00, 0x33, 0x33, 0x33, 0x33, 0x6E, 0x00 },  // 'u'
+    { 0x00, 0x00, 0x33, 0x33, 0x33, 0x1E, 0x0C, 0x00 },  // 'v'
+    { 0x00, 0x00, 0x63, 0x6B, 0x7F, 0x7F, 0x36, 0x00 },  // 'w'
+    { 0x00, 0x00, 0x63, 0x36, 0x1C, 0x36, 0x63, 0x00 },  // 'x'
+    { 0x00, 0x00, 0x33, 0x33, 0x33, 0x3E, 0x30, 0x1F },  // 'y'
+    { 0x00, 0x00, 0x3F, 0x19, 0x0C, 0x26, 0x3F, 0x00 },  // 'z'
+    { 0x38, 0x0C, 0x0C, 0x07, 0x0C, 0x0C, 0x38, 0x00 },  // '{'
+    { 0x18, 0x18, 0x18, 0x00, 0x18, 0x18, 0x18, 0x00 },  // '|'
+    { 0x07, 0x0C, 0x0C, 0x38, 0x0C, 0x0C, 0x07, 0x00 },  // '}'
+    { 0x6E, 0x3B, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },  // '~'
+};
+
+typedef struct framebuffer {
+    uint8_t *front;              // The mapped framebuffer
+    uint32_t *back;              // width * height pixels, no padding
+    uint32_t pitch;              // Bytes per framebuffer scanline
+    uint32_t width;              // In pixels
+    uint32_t height;
+    uint32_t cols;               // In character cells
+    uint32_t rows;
+    uint32_t cursor;             // Cell the next character goes into
+    uint32_t top;                // Back buffer text row shown at the top of the screen
+    uint32_t fg;                 // Pixel values in the framebuffer's layout
+    uint32_t bg;
+    uint32_t dirty_x0, dirty_y0; // Screen pixel rectangle waiting for a blit,
+    uint32_t dirty_x1, dirty_y1; // empty when x0 >= x1
+} framebuffer_t;
+
+static framebuffer_t fb;
+static bool fb_present = false;
+static bool fb_flushing = false;  // A blit is in progress, see fb_flush()
+static uint32_t fb_glyph_rows[256][FONT_WIDTH];  // Every 8-pixel bit pattern in fg/bg
+
+static uint32_t fb_rgb(uint8_t r, uint8_t g, uint8_t b) {
+    return ((uint32_t)(r >> (8 - boot_info->framebuffer_red_mask_size)) << boot_info->framebuffer_red_field_position) |
+           ((uint32_t)(g >> (8 - boot_info->framebuffer_green_mask_size)) << boot_info->framebuffer_green_field_position) |
+           ((uint32_t)(b >> (8 - boot_info->framebuffer_blue_mask_size)) << boot_info->framebuffer_blue_field_position);
+}
+
+static void fb_mark_dirty(uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1) {
+    if (fb.dirty_x0 >= fb.dirty_x1) {
+        fb.dirty_x0 = x0;
+        fb.dirty_y0 = y0;
+        fb.dirty_x1 = x1;
+        fb.dirty_y1 = y1;
+        return;
+    }
+    if (x0 < fb.dirty_x0) fb.dirty_x0 = x0;
+    if (y0 < fb.dirty_y0) fb.dirty_y0 = y0;
+    if (x1 > fb.dirty_x1) fb.dirty_x1 = x1;
+    if (y1 > fb.dirty_y1) fb.dirty_y1 = y1;
+}
+
+// Back buffer scanline holding screen scanline y. The pixel rows below the
+// last full text row aren't part of the ring.
+static inline uint32_t *fb_back_line(uint32_t y) {
+    uint32_t row = y / FONT_HEIGHT;
+    if (row < fb.rows) y = ((fb.top + row) % fb.rows) * FONT_HEIGHT + y % FONT_HEIGHT;
+    return &fb.back[y * fb.width];
+}
+
+static void fb_draw_glyph(uint32_t cell, char c) {
+    uint32_t x = (cell % fb.cols) * FONT_WIDTH;
+    uint32_t y = (cell / fb.cols) * FONT_HEIGHT;
+    uint8_t ch = (uint8_t)c;
+    const uint8_t *glyph = font8x8[(ch >= FONT_FIRST && ch <= FONT_LAST ? ch : '?') - FONT_FIRST];
+
+    uint32_t *pixel = fb_back_line(y) + x;
+    for (uint32_t row = 0; row < FONT_HEIGHT; row++, pixel += fb.width) {
+        memcpy(pixel, fb_glyph_rows[glyph[row]], sizeof(fb_glyph_rows[0]));
+    }
+    fb_mark_dirty(x, y, x + FONT_WIDTH, y + FONT_HEIGHT);
+}
+
+// Underline cursor, drawn by XOR so the same call removes it again
+static void fb_toggle_cursor() {
+    uint32_t x = (fb.cursor % fb.cols) * FONT_WIDTH;
+    uint32_t y = (fb.cursor / fb.cols) * FONT_HEIGHT + FONT_HEIGHT - 1;
+    uint32_t *pixel = fb_back_line(y) + x;
+    for (uint32_t i = 0; i < FONT_WIDTH; i++) pixel[i] ^= fb.fg ^ fb.bg;
+    fb_mark_dirty(x, y, x + FONT_WIDTH, y + 1);
+}
+
+static void fb_fill(uint32_t *pixel, uint32_t count) {
+    while (count--) *pixel++ = fb.bg;
+}
+
+// The old top row becomes the new bottom row
+static void fb_scroll() {
+    fb_fill(fb_back_line(0), fb.width * FONT_HEIGHT);
+    fb.top = (fb.top + 1) % fb.rows;
+    fb_mark_dirty(0, 0, fb.width, fb.rows * FONT_HEIGHT);
+}
+
+// Copy the dirty rectangle of the back buffer to the framebuffer. The
+// rectangle is taken with interrupts off and copied with them on; anything
+// written meanwhile (the keyboard echo, say) is dirty again and goes out on
+// the next pass. A flush from an interrupt during a blit leaves the work
+// to the blit it interrupted.
+void fb_flush() {
+    if (!fb_present) return;
+
+    for (;;) {
+        uint32_t flags = irq_save();
+        if (fb_flushing || fb.dirty_x0 >= fb.dirty_x1) {
+            irq_restore(flags);
+            return;
+        }
+        uint32_t x0 = fb.dirty_x0, y0 = fb.dirty_y0, x1 = fb.dirty_x1, y1 = fb.dirty_y1;
+        fb.dirty_x0 = fb.dirty_x1 = 0;
+        fb_flushing = true;
+        irq_restore(flags);
+
+        uint32_t bytes = (x1 - x0) * sizeof(uint32_t);
+        for (uint32_t y = y0; y < y1; y++) {
+            memcpy(fb.front + y * fb.pitch + x0 * sizeof(uint32_t), fb_back_line(y) + x0, bytes);
+        }
+        fb_flushing = false;
+    }
+}
+
+// Draw into the back buffer, call with interrupts off. fb_flush() puts it on screen.
+void fb_write(const char *s, size_t len) {
+    if (!fb_present) return;
+
+    uint32_t cells = fb.cols * fb.rows;
+    fb_toggle_cursor();
+    for (size_t i = 0; i < len; i++) {
+        char c = s[i];
+        if (c == '\n') {
+            fb.cursor += fb.cols - (fb.cursor % fb.cols);
+        } else if (c == '\b') {
+            if (fb.cursor > 0) fb_draw_glyph(--fb.cursor, ' ');
+        } else {
+            fb_draw_glyph(fb.cursor++, c);
+        }
+
+        if (fb.cursor >= cells) {
+            fb_scroll();
+            fb.cursor -= fb.cols;
+        }
+    }
+    fb_toggle_cursor();
+}
+
+// Switch to the loader's framebuffer if it is 32 bpp RGB. The text screen
+// is copied over so nothing printed so far is lost.
+bool init_framebuffer() {
+    if (!(boot_info->flags & MULTIBOOT_INFO_FRAMEBUFFER)) return false;
+    if (boot_info->framebuffer_type != MULTIBOOT_FRAMEBUFFER_TYPE_RGB ||
+        boot_info->framebuffer_bpp != 32) return false;
+
+    uint64_t phys = boot_info->framebuffer_addr;
+    uint32_t size = boot_info->framebuffer_pitch * boot_info->framebuffer_height;
+    if (phys >> 32 || size > FRAMEBUFFER_END - FRAMEBUFFER_START) return false;
+    if (boot_info->framebuffer_width < FONT_WIDTH || boot_info->framebuffer_height < FONT_HEIGHT) return false;
+
+    uint32_t *back = (uint32_t *)vm_alloc(boot_info->framebuffer_width * boot_info->framebuffer_height * sizeof(uint32_t), "framebuffer");
+    if (back == NULL) return false;
+    if (!map_range(FRAMEBUFFER_START, (uint32_t)phys, size, PAGE_RW)) {
+        vm_free(back);
+        return false;
+    }
+
+    fb = (framebuffer_t){
+        .front = (uint8_t *)FRAMEBUFFER_START,
+        .back = back,
+        .pitch = boot_info->framebuffer_pitch,
+        .width = boot_info->framebuffer_width,
+        .height = boot_info->framebuffer_height,
+        .cols = boot_info->framebuffer_width / FONT_WIDTH,
+        .rows = boot_info->framebuffer_height / FONT_HEIGHT,
+        .fg = fb_rgb(0xFF, 0xFF, 0xFF),  // Same white on blue as the text console
+        .bg = fb_rgb(0x00, 0x00, 0xAA),
+    };
+
+    for (uint32_t bits = 0; bits < 256; bits++) {
+        for (uint32_t i = 0; i < FONT_WIDTH; i++) {
+            fb_glyph_rows[bits][i] = (bits & (1 << i)) ? fb.fg : fb.bg;
+        }
+    }
+    fb_fill(fb.back, fb.width * fb.height);
+    fb_mark_dirty(0, 0, fb.width, fb.height);
+    fb_present = true;
+
+    // Replay the visible text screen up to the cursor
+    char line[TEXT_SCREEN_WIDTH];
+    for (int row = 0; row <= pos / TEXT_SCREEN_WIDTH; row++) {
+        uint16_t *cells = console_row(console_top + row);
+        int length = row < pos / TEXT_SCREEN_WIDTH ? TEXT_SCREEN_WIDTH : pos % TEXT_SCREEN_WIDTH;
+        for (int col = 0; col < length; col++) line[col] = (char)(cells[col] & 0xFF);
+        bool newline = row < pos / TEXT_SCREEN_WIDTH;
+        if (newline) {
+            while (length > 0 && line[length - 1] == ' ') length--;
+        }
+        fb_write(line, length);
+        if (newline) fb_write("\n", 1);
+    }
+    fb_flush();
+    return true;
+}
+
+#endif
@@ -2,6 +2,8 @@
 #define KLIB_H
 #include <stdbool.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <stdarg.h>
 
 void reverse(char str[], int length)
 {
@@ -43,40 +45,94 @@ void reverse(char str[], int length)
 // }
 
 
+// Decimal conversion emits two digits per division, looked up here, and
+// writes right to left so no reverse pass is needed
+static const char digit_pairs[201] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+// Digits of value written backwards so they end just before end, returns the first one
+static char *format_u32(uint32_t value, char *end) {
+    while (value >= 100) {
+        uint32_t pair = (value % 100) * 2;
+        value /= 100;
+        *--end = digit_pairs[pair + 1];
+        *--end = digit_pairs[pair];
+    }
+    if (value >= 10) {
+        *--end = digit_pairs[value * 2 + 1];
+        *--end = digit_pairs[value * 2];
+    } else {
+        *--end = '0' + value;
+    }
+    return end;
+}
+
+// 64 by 32 bit division in two divl steps, plain C would need libgcc's __udivdi3
+static inline uint64_t div_u64_u32(uint64_t value, uint32_t divisor, uint32_t *remainder) {
+    uint32_t high = (uint32_t)(value >> 32);
+    uint32_t q_high = high / divisor;
+    uint32_t q_low, rem;
+    __asm__("divl %4" : "=a"(q_low), "=d"(rem) : "a"((uint32_t)value), "d"(high % divisor), "rm"(divisor));
+    *remainder = rem;
+    return ((uint64_t)q_high << 32) | q_low;
+}
+
+static char *format_u64(uint64_t value, char *end) {
+    // Peel off nine digits at a time until the rest fits in 32 bits
+    while (value >> 32) {
+        uint32_t chunk;
+        value = div_u64_u32(value, 1000000000u, &chunk);
+        char *start = format_u32(chunk, end);
+        while (start > end - 9) *--start = '0';
+        end = start;
+    }
+    return format_u32((uint32_t)value, end);
+}
+
+static char *format_hex(uint64_t value, char *end, bool upper) {
+    const char *digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+    do {
+        *--end = digits[value & 0xF];
+        value >>= 4;
+    } while (value);
+    return end;
+}
+
 void itoa(int32_t value, char *str, int base) {
     if (base < 2 || base > 36) {
         *str = '\0'; // Invalid base
         return;
     }
 
-    char *ptr = str;
-    char *end = str;
+    char temp[34];
+    char *end = temp + sizeof(temp);
+    char *start;
     int is_negative = (value < 0 && base == 10); // Only base 10 supports negative numbers
-    uint32_t uvalue = (uint32_t)value;
-
-    if (is_negative) {
-        uvalue = (uint32_t)(-value); // Handle negative values by converting to unsigned
+    uint32_t uvalue = is_negative ? -(uint32_t)value : (uint32_t)value;
+
+    if (base == 10) {
+        start = format_u32(uvalue, end);
+    } else if (base == 16) {
+        start = format_hex(uvalue, end, true);
+    } else {
+        start = end;
+        do {
+            uint32_t digit = uvalue % base;
+            *--start = (digit > 9) ? ('A' + digit - 10) : ('0' + digit);
+            uvalue /= base;
+        } while (uvalue);
     }
 
-    // Convert the integer to the given base
-    do {
-        int digit = uvalue % base;
-        *end++ = (digit > 9) ? ('A' + digit - 10) : ('0' + digit);
-        uvalue /= base;
-    } while (uvalue);
-
     if (is_negative) {
-        *end++ = '-';
+        *--start = '-';
     }
 
-    *end = '\0'; // Null-terminate the string
-
-    // Reverse the string
-    while (end > ptr) {
-        char temp = *--end;
-        *end = *ptr;
-        *ptr++ = temp;
-    }
+    while (start < end) *str++ = *start++;
+    *str = '\0'; // Null-terminate the string
 }
 
 void ftoa(double value, char *str, int precision) {
@@ -131,90 +187,180 @@ void ftoa(double value, char *str, int precision) {
     *ptr = '\0';
 }
 
-int sprintf(char *buffer, const char *format, ...) {
-    va_list args;
-    va_start(args, format);
+// Output target of the formatter. Characters collect in buf; once it is
+// full, flush (if set) drains it and formatting carries on, otherwise the
+// rest is counted but dropped.
+typedef struct format_sink {
+    char *buf;
+    size_t size;                               // Capacity of buf
+    size_t len;                                // Characters waiting in buf
+    size_t total;                              // Characters produced, truncated ones too
+    void (*flush)(struct format_sink *sink);   // Optional, must empty buf
+} format_sink_t;
+
+static inline void sink_putc(format_sink_t *sink, char c) {
+    if (sink->len == sink->size && sink->flush) sink->flush(sink);
+    if (sink->len < sink->size) sink->buf[sink->len++] = c;
+    sink->total++;
+}
 
-    char *buf_ptr = buffer;
-    const char *fmt_ptr = format;
-
-    while (*fmt_ptr) {
-        if (*fmt_ptr == '%') {
-            fmt_ptr++; // Skip '%'
-
-            switch (*fmt_ptr) {
-                case 'd': { // Signed integer
-                    int value = va_arg(args, int);
-                    char temp[12]; // Temporary buffer for integer
-                    itoa(value, temp, 10); // Convert integer to string
-                    char *temp_ptr = temp;
-                    while (*temp_ptr) {
-                        *buf_ptr++ = *temp_ptr++;
-                    }
-                    break;
-                }
-                case 'u': { // Unsigned integer
-                    unsigned int value = va_arg(args, unsigned int);
-                    char temp[12];
-                    itoa((int)value, temp, 10); // Use itoa for unsigned
-                    char *temp_ptr = temp;
-                    while (*temp_ptr) {
-                        *buf_ptr++ = *temp_ptr++;
-                    }
-                    break;
-                }
-                case 'x': { // Hexadecimal
-                    unsigned int value = va_arg(args, unsigned int);
-                    char temp[12];
-                    itoa((int)value, temp, 16); // Convert to hexadecimal
-                    char *temp_ptr = temp;
-                    while (*temp_ptr) {
-                        *buf_ptr++ = *temp_ptr++;
-                    }
-                    break;
-                }
-                case 'f': { // Floating-point
-                    double value = va_arg(args, double);
-                    char temp[32]; // Temporary buffer for float
-                    ftoa(value, temp, 6); // Convert float to string with precision 6
-                    char *temp_ptr = temp;
-                    while (*temp_ptr) {
-                        *buf_ptr++ = *temp_ptr++;
-                    }
-                    break;
-                }
-                case 'c': { // Character
-                    char value = (char)va_arg(args, int);
-                    *buf_ptr++ = value;
-                    break;
-                }
-                case 's': { // String
-                    char *value = va_arg(args, char *);
-                    while (*value) {
-                        *buf_ptr++ = *value++;
-                    }
-                    break;
-                }
-                default: {
-                    // Handle unknown format specifiers
-                    *buf_ptr++ = '%';
-                    *buf_ptr++ = *fmt_ptr;
-                    break;
+static void sink_puts(format_sink_t *sink, const char *s) {
+    while (*s) sink_putc(sink, *s++);
+}
+
+// One converted field: padding, sign or 0x prefix, then the digits or text
+static void sink_field(format_sink_t *sink, const char *prefix, const char *text, size_t len,
+                       int width, char pad, bool left) {
+    int fill = width - (int)len;
+    for (const char *p = prefix; *p; p++) fill--;
+
+    if (!left && pad == ' ') while (fill-- > 0) sink_putc(sink, ' ');
+    sink_puts(sink, prefix);
+    if (!left && pad == '0') while (fill-- > 0) sink_putc(sink, '0');
+    for (size_t i = 0; i < len; i++) sink_putc(sink, text[i]);
+    if (left) while (fill-- > 0) sink_putc(sink, ' ');
+}
+
+// The one formatting engine behind printf(), sprintf() and snprintf().
+// Conversions: %d %i %u %x %X %p %c %s %f %%, with the flags '-' and '0',
+// a field width, a precision for %f and %s, and the ll length for 64 bits.
+int vformat(format_sink_t *sink, const char *format, va_list args) {
+    char temp[32]; // Digits are built right to left at the end of this
+
+    for (; *format; format++) {
+        if (*format != '%') {
+            sink_putc(sink, *format); // Copy regular characters
+            continue;
+        }
+
+        format++; // Skip '%'
+        bool left = false;
+        char pad = ' ';
+        for (;; format++) {
+            if (*format == '-') left = true;
+            else if (*format == '0') pad = '0';
+            else break;
+        }
+
+        int width = 0;
+        while (*format >= '0' && *format <= '9') width = width * 10 + (*format++ - '0');
+
+        int precision = -1;
+        if (*format == '.') {
+            format++;
+            precision = 0;
+            while (*format >= '0' && *format <= '9') precision = precision * 10 + (*format++ - '0');
+        }
+
+        int longs = 0; // 'l' is 32 bits here, 'll' is 64
+        while (*format == 'l' || *format == 'h' || *format == 'z') {
+            if (*format == 'l') longs++;
+            format++;
+        }
+
+        char *end = temp + sizeof(temp);
+        const char *start = end;
+        const char *prefix = "";
+
+        switch (*format) {
+            case 'd': // Signed integer
+            case 'i': {
+                int64_t value = longs >= 2 ? va_arg(args, int64_t) : va_arg(args, int);
+                uint64_t magnitude = value < 0 ? -(uint64_t)value : (uint64_t)value;
+                start = format_u64(magnitude, end);
+                if (value < 0) prefix = "-";
+                break;
+            }
+            case 'u': { // Unsigned integer
+                uint64_t value = longs >= 2 ? va_arg(args, uint64_t) : va_arg(args, unsigned int);
+                start = format_u64(value, end);
+                break;
+            }
+            case 'x': // Hexadecimal
+            case 'X': {
+                uint64_t value = longs >= 2 ? va_arg(args, uint64_t) : va_arg(args, unsigned int);
+                start = format_hex(value, end, *format == 'X');
+                break;
+            }
+            case 'p': { // Pointer, always eight digits
+                char *digits = format_hex((uintptr_t)va_arg(args, void *), end, false);
+                while (digits > end - 8) *--digits = '0';
+                start = digits;
+                prefix = "0x";
+                break;
+            }
+            case 'f': { // Floating-point
+                // Sign, up to 11 characters from itoa(), the point and the NUL
+                // leave room for this many digits in temp
+                int digits = precision < 0 ? 6 : precision;
+                if (digits > (int)sizeof(temp) - 14) digits = sizeof(temp) - 14;
+                ftoa(va_arg(args, double), temp, digits);
+                start = temp;
+                if (*start == '-') {
+                    prefix = "-";
+                    start++;
                 }
+                for (end = (char *)start; *end; end++);
+                break;
+            }
+            case 'c': // Character
+                temp[0] = (char)va_arg(args, int);
+                start = temp;
+                end = temp + 1;
+                break;
+            case 's': { // String
+                start = va_arg(args, const char *);
+                if (start == NULL) start = "(null)";
+                const char *stop = start;
+                while (*stop && (precision < 0 || stop - start < precision)) stop++;
+                sink_field(sink, "", start, stop - start, width, ' ', left);
+                continue;
             }
-        } else {
-            *buf_ptr++ = *fmt_ptr; // Copy regular characters
+            case '%': // Literal '%'
+                sink_putc(sink, '%');
+                continue;
+            case '\0': // Lone '%' at the end
+                return sink->total;
+            default: // Unknown specifiers are copied through
+                sink_putc(sink, '%');
+                sink_putc(sink, *format);
+                continue;
         }
-        fmt_ptr++;
+        sink_field(sink, prefix, start, end - start, width, pad, left);
     }
+    return sink->total;
+}
+
+// Bounded formatting, returns the length the full output would have had
+int vsnprintf(char *buffer, size_t size, const char *format, va_list args) {
+    format_sink_t sink = { .buf = buffer, .size = size ? size - 1 : 0 };
+    vformat(&sink, format, args);
+    if (size) buffer[sink.len] = '\0';
+    return sink.total;
+}
 
-    *buf_ptr = '\0'; // Null-terminate the buffer
+int snprintf(char *buffer, size_t size, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(buffer, size, format, args);
     va_end(args);
+    return length;
+}
 
-    return (buf_ptr - buffer); // Return the length of the formatted string
+int sprintf(char *buffer, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(buffer, SIZE_MAX, format, args);
+    va_end(args);
+    return length; // Return the length of the formatted string
 }
 
-void *memcpy(void *dst, const void *src, size_t n) {
+// String routines come in several variants, memcpy()/memset() call through
+// a pointer picked by setup_string_ops() once CPUID has been read. The
+// dword variants only need a 386 and are the default until then.
+#define STRING_SMALL 16  // Below this a plain loop beats the rep startup cost
+
+void *memcpy_bytes(void *dst, const void *src, size_t n) {
     uint8_t *d = (uint8_t *) dst;
     const uint8_t *s = (const uint8_t *) src;
     while (n--)
@@ -222,13 +368,130 @@ void *memcpy(void *dst, const void *src, size_t n) {
     return dst;
 }
 
-void *memset(void *buf, char c, size_t n) {
+// Align the destination, then rep movsd the bulk and rep movsb the tail
+void *memcpy_movsd(void *dst, const void *src, size_t n) {
+    if (n < STRING_SMALL) return memcpy_bytes(dst, src, n);
+
+    void *d = dst;
+    size_t head = (-(uintptr_t)dst) & 3;
+    n -= head;
+    size_t dwords = n >> 2;
+    __asm__ __volatile__(
+        "rep movsb\n\t"
+        "movl %3, %%ecx\n\t"
+        "rep movsl\n\t"
+        "movl %4, %%ecx\n\t"
+        "rep movsb\n\t"
+        : "+D"(d), "+S"(src), "+c"(head)
+        : "r"(dwords), "r"(n & 3)
+        : "memory"
+    );
+    return dst;
+}
+
+// Enhanced rep movsb (ERMS): microcode picks the best chunking by itself
+void *memcpy_erms(void *dst, const void *src, size_t n) {
+    if (n < STRING_SMALL) return memcpy_bytes(dst, src, n);
+
+    void *d = dst;
+    __asm__ __volatile__(
+        "rep movsb"
+        : "+D"(d), "+S"(src), "+c"(n)
+        :
+        : "memory"
+    );
+    return dst;
+}
+
+void *memset_bytes(void *buf, char c, size_t n) {
     uint8_t *p = (uint8_t *) buf;
     while (n--)
     *p++ = c;
     return buf;
 }
 
+void *memset_stosd(void *buf, char c, size_t n) {
+    if (n < STRING_SMALL) return memset_bytes(buf, c, n);
+
+    void *p = buf;
+    uint32_t pattern = (uint8_t)c * 0x01010101u;
+    size_t head = (-(uintptr_t)buf) & 3;
+    n -= head;
+    size_t dwords = n >> 2;
+    __asm__ __volatile__(
+        "rep stosb\n\t"
+        "movl %3, %%ecx\n\t"
+        "rep stosl\n\t"
+        "movl %4, %%ecx\n\t"
+        "rep stosb\n\t"
+        : "+D"(p), "+c"(head)
+        : "a"(pattern), "r"(dwords), "r"(n & 3)
+        : "memory"
+    );
+    return buf;
+}
+
+void *memset_erms(void *buf, char c, size_t n) {
+    if (n < STRING_SMALL) return memset_bytes(buf, c, n);
+
+    void *p = buf;
+    __asm__ __volatile__(
+        "rep stosb"
+        : "+D"(p), "+c"(n)
+        : "a"(c)
+        : "memory"
+    );
+    return buf;
+}
+
+void *(*memcpy_impl)(void *dst, const void *src, size_t n) = memcpy_movsd;
+void *(*memset_impl)(void *buf, char c, size_t n) = memset_stosd;
+
+void *memcpy(void *dst, const void *src, size_t n) {
+    return memcpy_impl(dst, src, n);
+}
+
+void *memset(void *buf, char c, size_t n) {
+    return memset_impl(buf, c, n);
+}
+
+// Overlap safe copy. Forward copies are fine whenever dst is below src,
+// otherwise copy backwards a byte at a time with the direction flag set.
+void *memmove(void *dst, const void *src, size_t n) {
+    if ((uintptr_t)dst <= (uintptr_t)src || (uintptr_t)dst >= (uintptr_t)src + n) {
+        return memcpy_impl(dst, src, n);
+    }
+
+    void *d = (uint8_t *)dst + n - 1;
+    const void *s = (const uint8_t *)src + n - 1;
+    __asm__ __volatile__(
+        "std\n\t"
+        "rep movsb\n\t"
+        "cld"
+        : "+D"(d), "+S"(s), "+c"(n)
+        :
+        : "memory"
+    );
+    return dst;
+}
+
+// Compare a dword at a time until a difference, then find the byte
+int memcmp(const void *a, const void *b, size_t n) {
+    const uint8_t *p = (const uint8_t *)a;
+    const uint8_t *q = (const uint8_t *)b;
+    while (n >= 4 && *(const uint32_t *)p == *(const uint32_t *)q) {
+        p += 4;
+        q += 4;
+        n -= 4;
+    }
+    while (n--) {
+        if (*p != *q) return *p - *q;
+        p++;
+        q++;
+    }
+    return 0;
+}
+
 char *strcpy(char *dst, const char *src) {
     char *d = dst;
     while (*src)
@@ -0,0 +1,131 @@
+#ifndef KLOG_H
+#define KLOG_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include "klib.h"
+#include "vga.h"
+
+// Kernel log, a fixed ring of timestamped records.
+// A writer claims the next sequence number with one locked xadd and owns
+// that slot outright, so klog() is safe from interrupt handlers and never
+// touches the console. klog_drain() echoes new records later from a
+// low-priority path; when writers lap it the oldest records are counted
+// as lost instead of blocking anyone: the scheduler's idle path drains it
+// while tasks run, kmain's loop once they are gone. klog_dump() replays
+// what is left, on F12 and after a fatal page fault.
+
+#define KLOG_ERR           0
+#define KLOG_WARN          1
+#define KLOG_INFO          2
+#define KLOG_DEBUG         3
+
+#define KLOG_RECORDS       256   // Power of two
+#define KLOG_TEXT_SIZE     112   // Keeps a record at 128 bytes
+#define KLOG_DRAIN_BATCH   8     // Records echoed per idle loop pass
+
+typedef struct klog_record {
+    volatile uint32_t seq;       // Sequence number + 1 once complete, 0 while being written
+    uint8_t level;
+    uint8_t length;
+    uint16_t reserved;
+    uint64_t tsc;
+    char text[KLOG_TEXT_SIZE];
+} klog_record_t;
+
+static klog_record_t klog_records[KLOG_RECORDS];
+static volatile uint32_t klog_head = 0;    // Next sequence number to hand out
+static uint32_t klog_drained = 0;          // Next sequence number the console has not seen
+static uint32_t klog_lost = 0;             // Overwritten before they were drained
+static int klog_console_level = KLOG_INFO; // Records above this are kept but not echoed
+
+static const char *klog_level_names[] = { "ERR", "WARN", "INFO", "DEBUG" };
+
+static inline uint64_t rdtsc() {
+    uint32_t low, high;
+    __asm__ __volatile__("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | low;
+}
+
+void vklog(int level, const char *format, va_list args) {
+    uint32_t seq = __atomic_fetch_add(&klog_head, 1, __ATOMIC_RELAXED);
+    klog_record_t *record = &klog_records[seq & (KLOG_RECORDS - 1)];
+
+    __atomic_store_n(&record->seq, 0, __ATOMIC_RELAXED);
+    record->tsc = rdtsc();
+    record->level = level;
+
+    int length = vsnprintf(record->text, KLOG_TEXT_SIZE, format, args);
+    if (length > KLOG_TEXT_SIZE - 1) length = KLOG_TEXT_SIZE - 1;
+    if (length > 0 && record->text[length - 1] == '\n') record->text[--length] = '\0';
+    record->length = length;
+
+    __atomic_store_n(&record->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+void klog(int level, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    vklog(level, format, args);
+    va_end(args);
+}
+
+// Copy record `seq` out of the ring. False if it is still being written or
+// has already been reused for a newer record.
+static bool klog_read(uint32_t seq, klog_record_t *out) {
+    klog_record_t *record = &klog_records[seq & (KLOG_RECORDS - 1)];
+    if (__atomic_load_n(&record->seq, __ATOMIC_ACQUIRE) != seq + 1) return false;
+    memcpy(out, record, sizeof(klog_record_t));
+    // A writer may have claimed the slot while we copied
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return record->seq == seq + 1;
+}
+
+static void klog_print(const klog_record_t *record) {
+    int level = record->level <= KLOG_DEBUG ? record->level : KLOG_DEBUG;
+    printf("[%12llu] %s: %s\n", record->tsc, klog_level_names[level], record->text);
+}
+
+// Echo up to `budget` records the console has not seen. Returns true while
+// more are waiting, so an idle loop knows not to halt yet.
+bool klog_drain(uint32_t budget) {
+    while (budget--) {
+        uint32_t head = __atomic_load_n(&klog_head, __ATOMIC_ACQUIRE);
+        if (klog_drained == head) return false;
+
+        if (head - klog_drained > KLOG_RECORDS) {
+            klog_lost += head - klog_drained - KLOG_RECORDS;
+            klog_drained = head - KLOG_RECORDS;
+        }
+
+        klog_record_t record;
+        if (!klog_read(klog_drained, &record)) {
+            uint32_t seq = klog_records[klog_drained & (KLOG_RECORDS - 1)].seq;
+            // Still being written by an interrupted writer, try again later
+            if (seq == 0 || (int32_t)(seq - (klog_drained + 1)) < 0) return true;
+            klog_lost++;
+            klog_drained++;
+            continue;
+        }
+
+        if (record.level <= klog_console_level) klog_print(&record);
+        klog_drained++;
+    }
+    return klog_drained != klog_head;
+}
+
+// Print every record still in the ring, whatever its level or drain state
+void klog_dump() {
+    uint32_t head = __atomic_load_n(&klog_head, __ATOMIC_ACQUIRE);
+    uint32_t first = head > KLOG_RECORDS ? head - KLOG_RECORDS : 0;
+
+    printf("Kernel log (%d records, %d lost):\n", head - first, klog_lost);
+    for (uint32_t seq = first; seq != head; seq++) {
+        klog_record_t record;
+        if (klog_read(seq, &record)) klog_print(&record);
+    }
+}
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef LIST_H
+#define LIST_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+// Intrusive circular doubly linked lists.
+// A list_node_t is embedded in the structure being listed, and list_entry()
+// gets back from the node to its container. A list is a sentinel node
+// whose next is the head and prev the tail, so insertion at either end and
+// removal of any node are O(1) and never walk the list. Removed nodes point
+// at themselves, which makes list_linked() a cheap membership test.
+
+typedef struct list_node {
+    struct list_node *next;
+    struct list_node *prev;
+} list_node_t;
+
+#define list_entry(node, type, member) ((type *)((char *)(node) - offsetof(type, member)))
+
+#define list_for_each(node, list) \
+    for (list_node_t *node = (list)->next; node != (list); node = node->next)
+
+static inline void list_init(list_node_t *list) {
+    list->next = list;
+    list->prev = list;
+}
+
+static inline bool list_empty(const list_node_t *list) {
+    return list->next == list;
+}
+
+// True while the node is on some list (nodes start out unlinked via list_init)
+static inline bool list_linked(const list_node_t *node) {
+    return node->next != node;
+}
+
+static inline void list_insert_between(list_node_t *node, list_node_t *prev, list_node_t *next) {
+    node->prev = prev;
+    node->next = next;
+    prev->next = node;
+    next->prev = node;
+}
+
+static inline void list_add_head(list_node_t *list, list_node_t *node) {
+    list_insert_between(node, list, list->next);
+}
+
+static inline void list_add_tail(list_node_t *list, list_node_t *node) {
+    list_insert_between(node, list->prev, list);
+}
+
+static inline void list_remove(list_node_t *node) {
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    list_init(node);
+}
+
+// First node of the list, NULL if it is empty
+static inline list_node_t *list_first(const list_node_t *list) {
+    return list_empty(list) ? NULL : list->next;
+}
+
+#endif
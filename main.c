@@ -2,7 +2,8 @@ __asm__ (
         // Define constants for the multiboot header
         ".set ALIGN, 1<<0\n"
         ".set MEMINFO, 1<<1\n"
-        ".set FLAGS, ALIGN | MEMINFO\n"
+        ".set VIDEO, 1<<2\n"
+        ".set FLAGS, ALIGN | MEMINFO | VIDEO\n"
         ".set MAGIC, 0x1BADB002\n"
         ".set CHECKSUM, -(MAGIC + FLAGS)\n"
 
@@ -12,8 +13,11 @@ __asm__ (
         ".long MAGIC\n"
         ".long FLAGS\n"
         ".long CHECKSUM\n"
-        ".long 0x100000\n"
-        ".long 0x1000\n"
+        ".long 0, 0, 0, 0, 0\n"  // Load addresses, only used with flag bit 16
+        ".long 0\n"              // Linear graphics mode
+        ".long 1600\n"           // Preferred width, 200 columns of 8x8 glyphs
+        ".long 1200\n"           // Preferred height
+        ".long 32\n"             // Bits per pixel
         
         // Stack section
         ".section .bss\n"
@@ -50,6 +54,7 @@ __asm__ (
 
 #include "vga.h"
 #include "memory.h"
+#include "framebuffer.h"
 #include "klib.h"
 
 // void task1() {
@@ -127,19 +132,6 @@ void process2_func() {
     // }
 }
 
-process_t process1 = {0};
-process_t process2 = {0};
-
-// Updated scheduler
-process_t *schedule() {
-    if (current_process == &process1 && process2.state == READY) {
-        return &process2;
-    } else if (current_process == &process2 && process1.state == READY) {
-        return &process1;
-    }
-    return current_process; // No switch if both processes are not READY
-}
-
 // void process1_func() {
 //     while (1) {
 //         printf("Process 1 is running\n");
@@ -163,25 +155,45 @@ multiboot_memory_map_t *boot_info;
 void kmain(multiboot_memory_map_t *info) {
     boot_info = info;
     clear();
+    init_serial();
+    if (serial_present) console_set_output(CONSOLE_VGA | CONSOLE_SERIAL);
     char str[20];
     puts("                               WELCOME TO ASHKEN OS                           \n\n\n");
     setup_gdt();
     puts("Setting up Global Descriptor Tables ...............................done\n");
+    setup_string_ops();
+    puts("Selecting String Routines .........................................done\n");
+    init_frame_allocator();
+    puts("Setting up Physical Frame Allocator ...............................done\n");
     setup_paging();
     puts("Setting up Paging Tables Identity Mapping .........................done\n");
     setup_idt();
     puts("Setting up Interrupt Descriptor Tables ............................done\n");
+    setup_fpu();
+    puts("Setting up FPU/SSE ................................................done\n");
     setup_PIC();
     puts("Setting up PIC ....................................................done\n");
     setup_PIT();
     puts("Setting up PIT ....................................................done\n");
+    init_timer();
+    puts("Calibrating TSC and Local APIC Timer ..............................done\n");
+    printf("TIMER: TSC %d kHz, LAPIC timer %d kHz, deadlines via %s\n", tsc_khz, lapic_timer_khz,
+           timer_device_names[timer_device]);
+    init_scheduler();
+    puts("Setting up Scheduler Run Queues ...................................done\n");
     enable_interrupts();
     puts("Enabling Hardware Interrupts.......................................done\n");
     puts("Testing interrupts.................................................\n");
     trigger_interrupt();
+    klog_drain(KLOG_RECORDS);
     init_keyboard();
     printf("Initializing Heap memory...........................................done\n");
     init_heap();
+    if (init_framebuffer()) {
+        console_set_output((console_outputs & ~CONSOLE_VGA) | CONSOLE_FRAMEBUFFER);
+        puts("Switching to Framebuffer Console ..................................done\n");
+        printf("FRAMEBUFFER: %dx%d pixels, %dx%d characters\n", fb.width, fb.height, fb.cols, fb.rows);
+    }
     //disable_interrupts();
     
     //hardware_info_t info = hardware_info();
@@ -201,6 +213,11 @@ void kmain(multiboot_memory_map_t *info) {
     unsigned long ram = get_physical_ram();
     mem_size memory = format_memory(ram);
     printf("CPU VENDOR: %s\nSYSTEM RAM: %d%s\n",(char*)ven,memory.size,memory.qualifier);
+    mem_size free_memory = format_memory(get_free_frames() * PAGE_SIZE);
+    printf("FREE RAM: %d%s\n",free_memory.size,free_memory.qualifier);
+#ifdef STRING_BENCH
+    string_bench();
+#endif
     char buffer[128];
 
     // sprintf(buffer, "Integer: %d, Unsigned: %u, Hex: %x, Float: %f, Char: %c, String: %s", 
@@ -238,30 +255,21 @@ void kmain(multiboot_memory_map_t *info) {
     process_t * proc1 = create_process((uint32_t)process1_func,stack_size);
     process_t * proc2 = create_process((uint32_t)process2_func,stack_size);
 
-    // Set up the ready queue
-    proc1->next = proc2;
-    proc2->next = NULL; // Circular queue
-    ready_queue = proc1;
-    proc1->state = RUNNING;
+    // Queue both on the scheduler's run queues
+    sched_enqueue(proc1);
+    sched_enqueue(proc2);
     //printf("Ready queue setup: Process 1 -> %x, Process 2 -> %x\n  , Process 1 real %x\n", proc1->next, proc2->next,proc1);
 
-    label_address = &&EXIT;
-
     // Scheduler loop
     // current_process = ready_queue;
     // process_t *next_process = current_process;
     // swtch(NULL, next_process);
 
-    // Start the scheduler loop
-    current_process = ready_queue;
+    printf("FIRST SP %x,   FP %x\n",proc1->stack_pointer,proc1->func);
+    printf("NEXT SP %x,  FP %x\n",proc2->stack_pointer,proc2->func);
 
-    printf("FIRST SP %x,   FP %x\n",current_process->stack_pointer,current_process->func);
-    printf("NEXT SP %x,  FP %x\n",current_process->next->stack_pointer,current_process->next->func);
-  
-    if (current_process) {
-        current_process->state = RUNNING; // Mark the first process as RUNNING
-        swtch(NULL, current_process);
-    }
+    // Start the scheduler loop, returns once every process has terminated
+    sched_start();
 
     // while (current_process) {
     //     next_process = current_process->next;
@@ -269,10 +277,20 @@ void kmain(multiboot_memory_map_t *info) {
     //     current_process = next_process;
     // }
 
-    EXIT:
     printf("All processes terminated. Returning to kmain.\n");
+    sched_stats();
+#ifdef HEAP_PROFILE
+    heap_report();
+#endif
     //print_queue_state();
-    for(;;);
+
+    // Idle: flush the log and zero frames for the pool while there is nothing else to do
+    for (;;) {
+        bool log_pending = klog_drain(KLOG_DRAIN_BATCH);
+        if (!pmm_refill_zero_pool(PMM_ZERO_BATCH) && !log_pending) {
+            __asm__ __volatile__("hlt");
+        }
+    }
 }
 
 
@@ -5,6 +5,14 @@
 #include "vga.h"
 #include "klib.h"
 #include "cpu.h"
+#include "multiboot.h"
+#include "pmm.h"
+#include "fpu.h"
+#include "serial.h"
+#include "klog.h"
+#include "apic.h"
+#include "timer.h"
+#include "sched.h"
 
 void enable_interrupts() {
     __asm__ __volatile__("sti");  // Set Interrupt Flag (enable interrupts)
@@ -29,10 +37,50 @@ struct GDTPointer {
     uint32_t base;       // Base address of the GDT
 } __attribute__((packed));
 
+// 32-bit task state segment. Only used for the double fault task switch
+struct TSS {
+    uint16_t link, reserved0;
+    uint32_t esp0;
+    uint16_t ss0, reserved1;
+    uint32_t esp1;
+    uint16_t ss1, reserved2;
+    uint32_t esp2;
+    uint16_t ss2, reserved3;
+    uint32_t cr3, eip, eflags;
+    uint32_t eax, ecx, edx, ebx, esp, ebp, esi, edi;
+    uint16_t es, reserved4;
+    uint16_t cs, reserved5;
+    uint16_t ss, reserved6;
+    uint16_t ds, reserved7;
+    uint16_t fs, reserved8;
+    uint16_t gs, reserved9;
+    uint16_t ldt, reserved10;
+    uint16_t trap, iomap_base;
+} __attribute__((packed));
+
+#define KERNEL_TSS_SELECTOR       0x20  // Receives the interrupted state on a double fault
+#define DOUBLE_FAULT_TSS_SELECTOR 0x28
+
+struct TSS kernel_tss;
+struct TSS double_fault_tss;
+
 // GDT and GDTR
-struct GDTEntry gdt[3]; // Null, Code, Data segments
+struct GDTEntry gdt[6]; // Null, Code, Data, Stack segments and the two TSSs
 struct GDTPointer gdt_ptr;
 
+// Available 32-bit TSS descriptor, byte granular
+static struct GDTEntry tss_descriptor(struct TSS *tss) {
+    uint32_t base = (uint32_t)tss;
+    return (struct GDTEntry){
+        .limit_low = sizeof(struct TSS) - 1,
+        .base_low = base & 0xFFFF,
+        .base_mid = (base >> 16) & 0xFF,
+        .access = 0x89,    // Present, ring 0, 32-bit TSS (available)
+        .granularity = 0x00,
+        .base_high = (base >> 24) & 0xFF
+    };
+}
+
 // Assembly function to load GDT
 void load_gdt(struct GDTPointer *gdt_ptr)
 {
@@ -87,7 +135,10 @@ void setup_gdt() {
         .granularity = 0xCF,   //
         .base_high = 0x0,
     };
-   
+
+    // A task switch needs a current TSS to save into, the double fault gate switches to the second
+    gdt[KERNEL_TSS_SELECTOR >> 3] = tss_descriptor(&kernel_tss);
+    gdt[DOUBLE_FAULT_TSS_SELECTOR >> 3] = tss_descriptor(&double_fault_tss);
 
     // GDTR setup
     gdt_ptr.limit = sizeof(gdt) - 1;
@@ -95,40 +146,10 @@ void setup_gdt() {
 
     // Load GDT
     load_gdt(&gdt_ptr);
+    __asm__ __volatile__("ltr %w0" : : "r"(KERNEL_TSS_SELECTOR));
 }
 
 
-//Multiboot 1 Memory info structure
-struct multiboot_mmap_entry
-{
-    uint32_t flags;          // Flags to indicate which information is available
-    uint32_t mem_lower;      // Lower memory size in KB
-    uint32_t mem_upper;      // Upper memory size in KB
-    uint32_t boot_device;    // Boot device (as specified by the bootloader)
-    uint32_t cmdline;        // Command line passed to the kernel (if any)
-    uint32_t mods_count;     // Number of modules loaded by the bootloader
-    uint32_t mods_addr;      // Address of the modules (if mods_count > 0)
-    // Optional fields depending on flags:
-    uint32_t num_boot_modules;  // Number of boot modules (only available if flags contain the appropriate bit)
-    uint32_t mmap_length;     // Length of the memory map (if provided)
-    uint32_t mmap_addr;       // Memory map address (if provided)
-    uint32_t drives_length;   // Length of the drives (if provided)
-    uint32_t drives_addr;     // Drives address (if provided)
-    uint32_t config_table;    // Configuration table address (if provided)
-    uint32_t boot_loader_name; // Boot loader name string address (if provided)
-    uint32_t apm_table;       // APM table address (if available)
-    uint32_t vbe_control_info; // VBE control info address (if provided)
-    uint32_t vbe_mode_info;   // VBE mode info address (if provided)
-    uint32_t vbe_mode;        // VBE mode (if available)
-    uint32_t vbe_interface_seg; // VBE interface segment (if available)
-    uint32_t vbe_interface_off; // VBE interface offset (if available)
-    uint32_t vbe_interface_len; // VBE interface length (if available)
-} __attribute__((packed));
-
-typedef struct multiboot_mmap_entry multiboot_memory_map_t;
-
-extern multiboot_memory_map_t *boot_info;
-
 //Calculate Physical Memory in bytes.
 uint32_t get_physical_ram() {
     uint32_t lower_memory = boot_info->mem_lower;  // Lower memory (KB)
@@ -179,20 +200,145 @@ mem_size format_memory(uint32_t size)
     return ram;
 }
 
+// Point memcpy()/memset() at the fastest variant this CPU has
+void setup_string_ops() {
+    uint32_t max_leaf, ebx, ecx, edx, eax;
+    cpuid(0, &ebx, &ecx, &edx, &max_leaf);
+
+    bool erms = false;
+    if (max_leaf >= 7) {
+        cpuid(7, &ebx, &ecx, &edx, &eax);
+        erms = (ebx & CPUID7_EBX_ERMS) != 0;
+    }
+
+    memcpy_impl = erms ? memcpy_erms : memcpy_movsd;
+    memset_impl = erms ? memset_erms : memset_stosd;
+}
+
+#ifdef STRING_BENCH
+// Build with make EXTRA_CFLAGS=-DSTRING_BENCH to time every memcpy/memset
+// variant from 8 B to 1 MB. Each figure is the best of several runs, in
+// TSC cycles per call.
+#define STRING_BENCH_RUNS 5
+
+static uint32_t string_bench_copy(void *(*fn)(void *, const void *, size_t),
+                                  void *dst, const void *src, size_t size) {
+    uint32_t reps = size < 65536 ? 65536 / size : 1;
+    uint64_t best = ~0ULL;
+    for (int run = 0; run < STRING_BENCH_RUNS; run++) {
+        uint64_t start = rdtsc();
+        for (uint32_t i = 0; i < reps; i++) fn(dst, src, size);
+        uint64_t cycles = rdtsc() - start;
+        if (cycles < best) best = cycles;
+    }
+    return (uint32_t)best / reps;
+}
+
+static uint32_t string_bench_set(void *(*fn)(void *, char, size_t), void *dst, size_t size) {
+    uint32_t reps = size < 65536 ? 65536 / size : 1;
+    uint64_t best = ~0ULL;
+    for (int run = 0; run < STRING_BENCH_RUNS; run++) {
+        uint64_t start = rdtsc();
+        for (uint32_t i = 0; i < reps; i++) fn(dst, 0x5A, size);
+        uint64_t cycles = rdtsc() - start;
+        if (cycles < best) best = cycles;
+    }
+    return (uint32_t)best / reps;
+}
+
+void string_bench() {
+    // Two 1 MB buffers, order 8 blocks are 256 frames
+    uint8_t *src = (uint8_t *)alloc_frames(8);
+    uint8_t *dst = (uint8_t *)alloc_frames(8);
+    if (src == NULL || dst == NULL) {
+        printf("string_bench: no memory\n");
+        return;
+    }
+    memset_bytes(src, 0x33, 1 << 20);
+
+    static const uint32_t sizes[] = { 8, 64, 512, 4096, 32768, 262144, 1 << 20 };
+    printf("Size     copy: bytes  movsd   erms   set: bytes  stosd   erms\n");
+    for (uint32_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        uint32_t size = sizes[i];
+        printf("%d\t%d\t%d\t%d\t%d\t%d\t%d\n", size,
+               string_bench_copy(memcpy_bytes, dst, src, size),
+               string_bench_copy(memcpy_movsd, dst, src, size),
+               string_bench_copy(memcpy_erms, dst, src, size),
+               string_bench_set(memset_bytes, dst, size),
+               string_bench_set(memset_stosd, dst, size),
+               string_bench_set(memset_erms, dst, size));
+    }
+
+    free_frames((uint32_t)src);
+    free_frames((uint32_t)dst);
+}
+#endif
+
 //Setup paging
-#define PAGE_SIZE 4096
 #define NUM_PAGE_TABLE_ENTRIES 1024
 #define NUM_PAGE_DIR_ENTRIES   1024
-#define NUM_PAGE_TABLES        ((4 * 1024) / 4)  // 4096 MB / 4 MB per table = 4 tables
 
-__attribute__((aligned(PAGE_SIZE))) uint32_t page_directory[NUM_PAGE_DIR_ENTRIES];
-__attribute__((aligned(PAGE_SIZE))) uint32_t page_tables[NUM_PAGE_TABLES][NUM_PAGE_TABLE_ENTRIES];
+#define PAGE_PRESENT    0x001
+#define PAGE_RW         0x002
+#define PAGE_PWT        0x008     // Write-through
+#define PAGE_PCD        0x010     // Cache disable, for device registers
+#define PAGE_LARGE      0x080     // PDE maps a 4 MB page (needs CR4.PSE)
+#define PAGE_GLOBAL     0x100     // Survives CR3 reloads (needs CR4.PGE)
+#define PAGE_COW        0x200     // Available bit: read-only share of a writable page
+#define LARGE_PAGE_SIZE 0x400000
+
+#define CR4_PSE         (1 << 4)
+#define CR4_PGE         (1 << 7)
+
+// Each address space owns [USER_SPACE_START, USER_SPACE_END), every other
+// directory slot is kernel space shared by all of them. The last slot maps
+// the directory onto itself so the current tables appear at PAGE_TABLES_VIRT.
+#define USER_SPACE_START  0x40000000
+#define USER_SPACE_END    0xC0000000
+#define RECURSIVE_PDE     1023
+#define PAGE_TABLES_VIRT  0xFFC00000  // Page table n is at PAGE_TABLES_VIRT + n * PAGE_SIZE
+#define PAGE_DIR_VIRT     0xFFFFF000  // The current page directory
+
+#define HEAP_START        0xC0000000  // Example heap start address
+#define HEAP_INITIAL_SIZE 0x10000     // 64 KB mapped by init_heap()
+#define HEAP_MAX_SIZE     0x4000000   // 64 MB of virtual space the heap may grow into
+#define HEAP_GROW_MIN     0x4000      // Map at least 16 KB whenever the heap grows
+#define HEAP_TRIM_MIN     0x10000     // Only unmap once 64 KB at the top are unused
+
+#define VMALLOC_START     0xC8000000  // Window for vm_alloc() reservations
+#define VMALLOC_END       0xD0000000
+
+#define STACK_START       0xD0000000  // Window for process stacks and their guard pages
+#define STACK_END         0xD4000000
+
+#define FRAMEBUFFER_START 0xD4000000  // Linear framebuffer, mapped by init_framebuffer()
+#define FRAMEBUFFER_END   0xD8000000
+
+#define MMIO_START        0xD8000000  // Device registers, mapped by map_mmio()
+#define MMIO_END          0xD8400000
+
+__attribute__((aligned(PAGE_SIZE))) uint32_t page_directory[NUM_PAGE_DIR_ENTRIES];  // Kernel address space
+bool paging_uses_pse = false;
+bool paging_uses_global = false;
+bool paging_enabled = false;
+
+typedef struct address_space {
+    uint32_t *page_directory;     // Identity mapped, so also the value loaded into CR3
+    uint32_t ref_count;           // Processes using this address space
+    struct address_space *next;   // Next in address_spaces
+} address_space_t;
+
+// Every live directory, kernel slot changes are written to all of them
+address_space_t kernel_address_space = { .page_directory = page_directory, .ref_count = 1 };
+address_space_t *address_spaces = &kernel_address_space;
+address_space_t *current_address_space = &kernel_address_space;
+kmem_cache_t *address_space_cache = NULL;
 
 void load_page_directory_and_enable_paging(uint32_t *page_directory) {
     __asm__ __volatile__(
         "movl %0, %%cr3\n\t"
         "movl %%cr0, %%eax\n\t"
-        "orl $0x80000001, %%eax\n\t"
+        "orl $0x80010001, %%eax\n\t"  // PG, WP (ring 0 honours read-only pages) and PE
         "movl %%eax, %%cr0\n\t"
         :
         : "r"(page_directory)
@@ -200,67 +346,773 @@ void load_page_directory_and_enable_paging(uint32_t *page_directory) {
     );
 }
 
+static inline void write_cr3(uint32_t value) {
+    __asm__ __volatile__("movl %0, %%cr3" : : "r"(value) : "memory");
+}
+
+// Drops every non-global translation
+void flush_tlb() {
+    __asm__ __volatile__(
+        "movl %%cr3, %%eax\n\t"
+        "movl %%eax, %%cr3\n\t"
+        : : : "eax", "memory"
+    );
+}
+
+// Drops global translations too, toggling CR4.PGE is the only way short of invlpg
+void flush_tlb_global() {
+    uint32_t cr4 = read_cr4();
+    if (cr4 & CR4_PGE) {
+        write_cr4(cr4 & ~CR4_PGE);
+        write_cr4(cr4);
+    } else {
+        flush_tlb();
+    }
+}
+
+// Is this directory slot inside a window mapped with 4 KB pages (heap,
+// vm_alloc, stacks, framebuffer, MMIO)?
+static inline bool is_kernel_window_pde(uint32_t pd_index) {
+    return (pd_index >= (HEAP_START >> 22) && pd_index < ((HEAP_START + HEAP_MAX_SIZE) >> 22)) ||
+           (pd_index >= (VMALLOC_START >> 22) && pd_index < (VMALLOC_END >> 22)) ||
+           (pd_index >= (STACK_START >> 22) && pd_index < (STACK_END >> 22)) ||
+           (pd_index >= (FRAMEBUFFER_START >> 22) && pd_index < (FRAMEBUFFER_END >> 22)) ||
+           (pd_index >= (MMIO_START >> 22) && pd_index < (MMIO_END >> 22));
+}
+
+// Is this directory slot private to each address space?
+static inline bool is_user_pde(uint32_t pd_index) {
+    return pd_index >= (USER_SPACE_START >> 22) && pd_index < (USER_SPACE_END >> 22);
+}
+
 void setup_paging() {
-    // Create 4 page tables to map the first 16 MB
-    for (uint32_t table = 0; table < NUM_PAGE_TABLES; table++) {
-        for (uint32_t i = 0; i < NUM_PAGE_TABLE_ENTRIES; i++) {
-            page_tables[table][i] = (table * 4 * 1024 * 1024 + i * PAGE_SIZE) | 3; // Address + Present + RW
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &ebx, &ecx, &edx, &eax);
+
+    // Clear the page directory
+    for (uint32_t i = 0; i < NUM_PAGE_DIR_ENTRIES; i++) {
+        page_directory[i] = 0;
+    }
+
+    // Kernel pages are global so address space switches keep their TLB entries
+    if (edx & CPUID_EDX_PGE) {
+        write_cr4(read_cr4() | CR4_PGE);
+        paging_uses_global = true;
+    }
+
+    if (edx & CPUID_EDX_PSE) {
+        // Identity map the kernel slots with 4 MB pages, no page tables needed.
+        // The kernel windows get 4 KB tables below.
+        write_cr4(read_cr4() | CR4_PSE);
+        paging_uses_pse = true;
+        for (uint32_t pd = 0; pd < NUM_PAGE_DIR_ENTRIES; pd++) {
+            if (is_kernel_window_pde(pd) || is_user_pde(pd) || pd == RECURSIVE_PDE) continue;
+            page_directory[pd] = (pd * LARGE_PAGE_SIZE) | PAGE_GLOBAL | PAGE_LARGE | PAGE_RW | PAGE_PRESENT;
+        }
+    } else {
+        // No PSE: identity map physical RAM with 4 KB tables from the frame allocator
+        uint32_t tables = (get_memory_top() + LARGE_PAGE_SIZE - 1) / LARGE_PAGE_SIZE;
+        for (uint32_t pd = 0; pd < tables && pd < (USER_SPACE_START >> 22); pd++) {
+            uint32_t *page_table = (uint32_t *)alloc_frame();
+            if (page_table == NULL) break;
+            for (uint32_t i = 0; i < NUM_PAGE_TABLE_ENTRIES; i++) {
+                page_table[i] = (pd * LARGE_PAGE_SIZE + i * PAGE_SIZE) | PAGE_GLOBAL | PAGE_RW | PAGE_PRESENT;
+            }
+            page_directory[pd] = (uint32_t)page_table | PAGE_RW | PAGE_PRESENT;
         }
-        // Point the corresponding page directory entry to the page table
-        page_directory[table] = ((uint32_t)page_tables[table]) | 3; // Address + Present + RW
     }
 
-    // Clear the rest of the page directory
-    for (uint32_t i = NUM_PAGE_TABLES; i < NUM_PAGE_DIR_ENTRIES; i++) {
-        page_directory[i] = 0;
+    // Kernel windows get their tables now so kernel slots never change after
+    // boot and can be copied into new address spaces by value
+    for (uint32_t pd = 0; pd < NUM_PAGE_DIR_ENTRIES; pd++) {
+        if (!is_kernel_window_pde(pd)) continue;
+        uint32_t *page_table = (uint32_t *)alloc_frames_flags(0, ALLOC_ZEROED);
+        if (page_table == NULL) break;
+        page_directory[pd] = (uint32_t)page_table | PAGE_RW | PAGE_PRESENT;
     }
 
+    page_directory[RECURSIVE_PDE] = (uint32_t)page_directory | PAGE_RW | PAGE_PRESENT;
+
     // Load the page directory and enable paging
     load_page_directory_and_enable_paging(page_directory);
+    paging_enabled = true;
+}
+
+#define TLB_FLUSH_THRESHOLD 32  // Invalidate page by page up to this many, reload CR3 beyond
+
+typedef struct paging_stats {
+    uint32_t pages_mapped;        // 4 KB entries written
+    uint32_t large_pages_mapped;  // 4 MB directory entries written
+    uint32_t pages_unmapped;      // Present entries cleared
+    uint32_t tables_allocated;    // Page tables taken from the frame allocator
+    uint32_t invlpg_issued;       // Single-page invalidations
+    uint32_t tlb_flushes;         // Full CR3 reloads
+    uint32_t cr3_switches;        // Address space switches that loaded CR3
+    uint32_t cr3_switches_skipped;// Switches between tasks sharing an address space
+    uint32_t pages_shared;        // User pages shared by address_space_clone()
+    uint32_t cow_faults;          // Writes to copy-on-write pages
+    uint32_t cow_copies;          // ...that had to copy because the frame was still shared
+} paging_stats_t;
+
+paging_stats_t paging_stats = {0};
+
+// Addresses whose translation changed, invalidated together at the end of an operation
+typedef struct tlb_batch {
+    uint32_t count;
+    bool global;                  // Some address is kernel space, CR3 reload is not enough
+    uint32_t addresses[TLB_FLUSH_THRESHOLD];
+} tlb_batch_t;
+
+static inline void invlpg(uint32_t address) {
+    __asm__ __volatile__("invlpg (%0)" : : "r"(address) : "memory");
+}
+
+static void tlb_batch_add(tlb_batch_t *batch, uint32_t address) {
+    if (batch->count < TLB_FLUSH_THRESHOLD) batch->addresses[batch->count] = address;
+    if (!is_user_pde(address >> 22)) batch->global = true;
+    batch->count++;
+}
+
+static void tlb_batch_flush(tlb_batch_t *batch) {
+    if (batch->count == 0) return;
+    if (batch->count > TLB_FLUSH_THRESHOLD) {
+        if (batch->global) flush_tlb_global();
+        else flush_tlb();
+        paging_stats.tlb_flushes++;
+    } else {
+        for (uint32_t i = 0; i < batch->count; i++) invlpg(batch->addresses[i]);
+        paging_stats.invlpg_issued += batch->count;
+    }
+    batch->count = 0;
+    batch->global = false;
+}
+
+// The current directory and its tables, through the recursive slot once paging is on
+static inline uint32_t *active_page_directory() {
+    return paging_enabled ? (uint32_t *)PAGE_DIR_VIRT : page_directory;
+}
+
+static inline uint32_t *page_table_at(uint32_t pd_index) {
+    return paging_enabled ? (uint32_t *)(PAGE_TABLES_VIRT + pd_index * PAGE_SIZE)
+                          : (uint32_t *)(page_directory[pd_index] & 0xFFFFF000);
+}
+
+// Kernel mappings are global and shared by every address space
+static inline uint32_t page_flags_for(uint32_t virt, uint32_t flags) {
+    return is_user_pde(virt >> 22) ? (flags & 0xFFF) : ((flags & 0xFFF) | PAGE_GLOBAL);
+}
+
+// Kernel slots are written to every directory, user slots only to the current one
+static void set_pde(uint32_t pd_index, uint32_t value) {
+    if (is_user_pde(pd_index)) {
+        active_page_directory()[pd_index] = value;
+    } else {
+        for (address_space_t *as = address_spaces; as; as = as->next) {
+            as->page_directory[pd_index] = value;
+        }
+    }
+    // The recursive window view of this table changed as well
+    if (paging_enabled) invlpg(PAGE_TABLES_VIRT + pd_index * PAGE_SIZE);
+}
+
+// Page table covering pd_index, allocated (or split out of a 4 MB page) if needed
+static uint32_t *get_page_table(uint32_t pd_index, bool create, tlb_batch_t *batch) {
+    uint32_t pde = active_page_directory()[pd_index];
+
+    if ((pde & PAGE_PRESENT) && !(pde & PAGE_LARGE)) {
+        return page_table_at(pd_index);
+    }
+    if (!create && !(pde & PAGE_PRESENT)) return NULL;
+
+    // Allocate a new page table (aligned to 4 KB)
+    uint32_t *page_table = (uint32_t *)alloc_frame();
+    if (page_table == NULL) return NULL;
+    paging_stats.tables_allocated++;
+
+    for (uint32_t i = 0; i < NUM_PAGE_TABLE_ENTRIES; i++) {
+        // A 4 MB page is broken up into the same mapping with 4 KB entries
+        page_table[i] = (pde & PAGE_PRESENT)
+            ? ((pde & 0xFFC00000) + i * PAGE_SIZE) | (pde & 0xFFF & ~PAGE_LARGE)
+            : 0;
+    }
+    set_pde(pd_index, (uint32_t)page_table | PAGE_RW | PAGE_PRESENT);
+    if (pde & PAGE_PRESENT) tlb_batch_add(batch, pd_index << 22);
+
+    return page_table_at(pd_index);
 }
 
+// Bytes from address to the end of its 4 MB directory slot, capped at remaining
+static inline uint32_t bytes_to_pde_end(uint32_t address, uint32_t remaining) {
+    uint32_t span = LARGE_PAGE_SIZE - (address & (LARGE_PAGE_SIZE - 1));
+    return span < remaining ? span : remaining;
+}
+
+// Map [virt, virt+size) to [phys, phys+size). 4 MB pages are used wherever
+// both addresses are 4 MB aligned and no 4 KB table is already in the way.
+bool map_range(uint32_t virt, uint32_t phys, uint32_t size, uint32_t flags) {
+    tlb_batch_t batch = { .count = 0 };
+    uint32_t remaining = page_align_up(size + (virt & (PAGE_SIZE - 1)));
+    virt = page_align_down(virt);
+    phys = page_align_down(phys);
+    bool mapped = true;
+
+    while (remaining) {
+        uint32_t pd_index = virt >> 22;
+        uint32_t pde = active_page_directory()[pd_index];
+        uint32_t step = PAGE_SIZE;
+
+        // User space is 4 KB only, so every user page can be shared copy-on-write
+        if (paging_uses_pse && !is_user_pde(pd_index) && remaining >= LARGE_PAGE_SIZE &&
+            !(virt & (LARGE_PAGE_SIZE - 1)) && !(phys & (LARGE_PAGE_SIZE - 1)) &&
+            !((pde & PAGE_PRESENT) && !(pde & PAGE_LARGE))) {
+            set_pde(pd_index, phys | page_flags_for(virt, flags) | PAGE_LARGE | PAGE_PRESENT);
+            if (pde & PAGE_PRESENT) tlb_batch_add(&batch, virt);
+            paging_stats.large_pages_mapped++;
+            step = LARGE_PAGE_SIZE;
+        } else {
+            uint32_t *page_table = get_page_table(pd_index, true, &batch);
+            if (page_table == NULL) {
+                mapped = false;
+                break;
+            }
+            uint32_t pt_index = (virt >> 12) & 0x3FF;
+            if (page_table[pt_index] & PAGE_PRESENT) tlb_batch_add(&batch, virt);
+            page_table[pt_index] = phys | page_flags_for(virt, flags) | PAGE_PRESENT;
+            paging_stats.pages_mapped++;
+        }
+
+        virt += step;
+        phys += step;
+        remaining -= step;
+    }
+
+    tlb_batch_flush(&batch);
+    return mapped;
+}
+
+// Unmap [virt, virt+size). With release_frames the frames behind 4 KB
+// entries go back to the frame allocator (4 MB pages are never released).
+void unmap_range(uint32_t virt, uint32_t size, bool release_frames) {
+    tlb_batch_t batch = { .count = 0 };
+    uint32_t remaining = page_align_up(size + (virt & (PAGE_SIZE - 1)));
+    virt = page_align_down(virt);
+
+    while (remaining) {
+        uint32_t pd_index = virt >> 22;
+        uint32_t pde = active_page_directory()[pd_index];
+        uint32_t step = PAGE_SIZE;
+
+        if (!(pde & PAGE_PRESENT)) {
+            step = bytes_to_pde_end(virt, remaining);
+        } else if ((pde & PAGE_LARGE) && !(virt & (LARGE_PAGE_SIZE - 1)) && remaining >= LARGE_PAGE_SIZE) {
+            set_pde(pd_index, 0);
+            tlb_batch_add(&batch, virt);
+            paging_stats.pages_unmapped++;
+            step = LARGE_PAGE_SIZE;
+        } else {
+            uint32_t *page_table = get_page_table(pd_index, false, &batch);
+            if (page_table == NULL) break;
+            uint32_t pt_index = (virt >> 12) & 0x3FF;
+            uint32_t entry = page_table[pt_index];
+            if (entry & PAGE_PRESENT) {
+                page_table[pt_index] = 0;
+                tlb_batch_add(&batch, virt);
+                paging_stats.pages_unmapped++;
+                if (release_frames) free_frame(entry & 0xFFFFF000);
+            }
+        }
+
+        virt += step;
+        remaining -= step;
+    }
+
+    tlb_batch_flush(&batch);
+}
+
+// Replace the flag bits of every present page in [virt, virt+size)
+void protect_range(uint32_t virt, uint32_t size, uint32_t flags) {
+    tlb_batch_t batch = { .count = 0 };
+    uint32_t remaining = page_align_up(size + (virt & (PAGE_SIZE - 1)));
+    virt = page_align_down(virt);
+
+    while (remaining) {
+        uint32_t pd_index = virt >> 22;
+        uint32_t pde = active_page_directory()[pd_index];
+        uint32_t step = PAGE_SIZE;
+
+        if (!(pde & PAGE_PRESENT)) {
+            step = bytes_to_pde_end(virt, remaining);
+        } else if ((pde & PAGE_LARGE) && !(virt & (LARGE_PAGE_SIZE - 1)) && remaining >= LARGE_PAGE_SIZE) {
+            set_pde(pd_index, (pde & 0xFFC00000) | page_flags_for(virt, flags) | PAGE_LARGE | PAGE_PRESENT);
+            tlb_batch_add(&batch, virt);
+            step = LARGE_PAGE_SIZE;
+        } else {
+            uint32_t *page_table = get_page_table(pd_index, false, &batch);
+            if (page_table == NULL) break;
+            uint32_t pt_index = (virt >> 12) & 0x3FF;
+            uint32_t entry = page_table[pt_index];
+            if (entry & PAGE_PRESENT) {
+                page_table[pt_index] = (entry & 0xFFFFF000) | page_flags_for(virt, flags) | PAGE_PRESENT;
+                tlb_batch_add(&batch, virt);
+            }
+        }
+
+        virt += step;
+        remaining -= step;
+    }
+
+    tlb_batch_flush(&batch);
+}
 
 // Function to map a virtual address to a physical address
 void map_page(uint32_t virtual_address, uint32_t physical_address, uint32_t flags) {
-    uint32_t pd_index = (virtual_address >> 22) & 0x3FF; // Top 10 bits
-    uint32_t pt_index = (virtual_address >> 12) & 0x3FF; // Next 10 bits
+    map_range(virtual_address, physical_address, PAGE_SIZE, flags);
+}
+
+static uint32_t mmio_next = MMIO_START;  // Bump pointer, device mappings are never undone
+
+// Map device registers uncached into the MMIO window. Identity mapping them
+// would split a 4 MB kernel page, and kernel slots never change after boot.
+// Returns them or NULL if the window or memory ran out.
+void *map_mmio(uint32_t phys, uint32_t size) {
+    uint32_t offset = phys & (PAGE_SIZE - 1);
+    size = page_align_up(size + offset);
+    if (MMIO_END - mmio_next < size) return NULL;
+
+    uint32_t virt = mmio_next;
+    if (!map_range(virt, phys - offset, size, PAGE_PCD | PAGE_PWT | PAGE_RW)) return NULL;
+    mmio_next += size;
+    return (void *)(virt + offset);
+}
 
-    // Ensure the page table exists
-    if (!(page_directory[pd_index] & 1)) {
-        // Allocate a new page table (aligned to 4 KB)
-        uint32_t new_page_table = (uint32_t)&page_tables[pd_index];
-        page_directory[pd_index] = new_page_table | flags | 1; // Present + RW
+// Remove a mapping, returns the physical frame it pointed to (0 if none)
+uint32_t unmap_page(uint32_t virtual_address) {
+    tlb_batch_t batch = { .count = 0 };
+    uint32_t pd_index = (virtual_address >> 22) & 0x3FF;
+    uint32_t pt_index = (virtual_address >> 12) & 0x3FF;
+
+    uint32_t *page_table = get_page_table(pd_index, false, &batch);
+    if (page_table == NULL) return 0;
+
+    uint32_t entry = page_table[pt_index];
+    page_table[pt_index] = 0;
+    if (entry & PAGE_PRESENT) {
+        tlb_batch_add(&batch, virtual_address);
+        paging_stats.pages_unmapped++;
     }
+    tlb_batch_flush(&batch);
 
-    // Get the address of the page table
-    uint32_t *page_table = (uint32_t *)(page_directory[pd_index] & 0xFFFFF000);
+    return (entry & PAGE_PRESENT) ? (entry & 0xFFFFF000) : 0;
+}
+
+void print_paging_stats() {
+    printf("Paging: %d pages and %d large pages mapped, %d unmapped\n",
+           paging_stats.pages_mapped, paging_stats.large_pages_mapped, paging_stats.pages_unmapped);
+    printf("        %d tables allocated, %d invlpg, %d CR3 reloads\n",
+           paging_stats.tables_allocated, paging_stats.invlpg_issued, paging_stats.tlb_flushes);
+    printf("        %d address space switches, %d skipped\n",
+           paging_stats.cr3_switches, paging_stats.cr3_switches_skipped);
+    printf("        %d pages shared, %d copy-on-write faults, %d copies\n",
+           paging_stats.pages_shared, paging_stats.cow_faults, paging_stats.cow_copies);
+}
 
-    // Map the page
-    page_table[pt_index] = (physical_address & 0xFFFFF000) | (flags & 0xFFF) | 1; // Present + RW
+// New address space: kernel slots copied from the kernel directory (the
+// tables behind them are shared), empty user slots and its own recursive slot
+address_space_t *address_space_create() {
+    if (address_space_cache == NULL) {
+        address_space_cache = kmem_cache_create("address_space_t", sizeof(address_space_t), 0, NULL);
+        if (address_space_cache == NULL) return NULL;
+    }
+
+    address_space_t *as = (address_space_t *)kmem_cache_alloc(address_space_cache);
+    if (as == NULL) return NULL;
+
+    uint32_t *directory = (uint32_t *)alloc_frame();
+    if (directory == NULL) {
+        kmem_cache_free(address_space_cache, as);
+        return NULL;
+    }
+
+    for (uint32_t pd = 0; pd < NUM_PAGE_DIR_ENTRIES; pd++) {
+        directory[pd] = is_user_pde(pd) ? 0 : page_directory[pd];
+    }
+    directory[RECURSIVE_PDE] = (uint32_t)directory | PAGE_RW | PAGE_PRESENT;
+
+    as->page_directory = directory;
+    as->ref_count = 1;
+    as->next = address_spaces;
+    address_spaces = as;
+    return as;
+}
+
+// Drop a reference, the last one frees the user page tables and their frames.
+// Callers switch away first: the last reference to the loaded space is kept
+// (and the space leaked) rather than freeing the directory under the CPU.
+void address_space_release(address_space_t *as) {
+    if (as == NULL || as == &kernel_address_space) return;
+    if (as->ref_count == 1 && as == current_address_space) {
+        klog(KLOG_ERR, "mm: last reference to the loaded address space %x dropped, leaking it",
+             (uint32_t)as->page_directory);
+        return;
+    }
+    if (--as->ref_count > 0) return;
+
+    for (address_space_t **link = &address_spaces; *link; link = &(*link)->next) {
+        if (*link == as) {
+            *link = as->next;
+            break;
+        }
+    }
+
+    for (uint32_t pd = USER_SPACE_START >> 22; pd < (USER_SPACE_END >> 22); pd++) {
+        uint32_t pde = as->page_directory[pd];
+        if (!(pde & PAGE_PRESENT) || (pde & PAGE_LARGE)) continue;
+        uint32_t *page_table = (uint32_t *)(pde & 0xFFFFF000);
+        for (uint32_t i = 0; i < NUM_PAGE_TABLE_ENTRIES; i++) {
+            if (page_table[i] & PAGE_PRESENT) free_frame(page_table[i] & 0xFFFFF000);
+        }
+        free_frame((uint32_t)page_table);
+    }
+
+    free_frame((uint32_t)as->page_directory);
+    kmem_cache_free(address_space_cache, as);
+}
+
+// Copy of an address space (NULL means the kernel one) that shares every user
+// page with it. Writable pages become read-only PAGE_COW in both and are only
+// copied on the first write, so the cost is the page tables, not the memory.
+address_space_t *address_space_clone(address_space_t *src) {
+    if (src == NULL) src = &kernel_address_space;
+
+    address_space_t *as = address_space_create();
+    if (as == NULL) return NULL;
+
+    bool write_protected = false;
+    bool failed = false;
+    for (uint32_t pd = USER_SPACE_START >> 22; pd < (USER_SPACE_END >> 22); pd++) {
+        uint32_t pde = src->page_directory[pd];
+        if (!(pde & PAGE_PRESENT)) continue;
+
+        uint32_t *page_table = (uint32_t *)alloc_frame();
+        if (page_table == NULL) {
+            failed = true;
+            break;
+        }
+        paging_stats.tables_allocated++;
+
+        // Tables are identity mapped, so the source need not be the current space
+        uint32_t *src_table = (uint32_t *)(pde & 0xFFFFF000);
+        for (uint32_t i = 0; i < NUM_PAGE_TABLE_ENTRIES; i++) {
+            uint32_t entry = src_table[i];
+            if (entry & PAGE_PRESENT) {
+                if (entry & PAGE_RW) {
+                    entry = (entry & ~PAGE_RW) | PAGE_COW;
+                    src_table[i] = entry;
+                    write_protected = true;
+                }
+                ref_frame(entry & 0xFFFFF000);
+                paging_stats.pages_shared++;
+            }
+            page_table[i] = entry;
+        }
+        as->page_directory[pd] = (uint32_t)page_table | (pde & 0xFFF);
+    }
+
+    // User entries are not global, one CR3 reload drops the stale writable ones
+    if (write_protected && src == current_address_space) {
+        flush_tlb();
+        paging_stats.tlb_flushes++;
+    }
+
+    if (failed) {
+        address_space_release(as);
+        return NULL;
+    }
+    return as;
+}
+
+// Write to a copy-on-write page. The last sharer takes the frame over,
+// anyone else gets a private copy.
+static bool handle_cow_fault(uint32_t address) {
+    uint32_t pd_index = address >> 22;
+    uint32_t pde = active_page_directory()[pd_index];
+    if (!(pde & PAGE_PRESENT) || (pde & PAGE_LARGE)) return false;
+
+    uint32_t *page_table = page_table_at(pd_index);
+    uint32_t pt_index = (address >> 12) & 0x3FF;
+    uint32_t entry = page_table[pt_index];
+    if (!(entry & PAGE_PRESENT) || !(entry & PAGE_COW)) return false;
+
+    uint32_t frame = entry & 0xFFFFF000;
+    paging_stats.cow_faults++;
+    if (frame_ref_count(frame) > 1) {
+        uint32_t copy = alloc_frame();
+        if (copy == 0) return false;
+        memcpy((void *)copy, (void *)frame, PAGE_SIZE);
+        free_frame(frame);  // Drops this mapping's reference only
+        frame = copy;
+        paging_stats.cow_copies++;
+    }
+
+    page_table[pt_index] = frame | (entry & 0xFFF & ~PAGE_COW) | PAGE_RW;
+    invlpg(page_align_down(address));
+    return true;
+}
+
+// Load an address space (NULL means the kernel one). Kernel translations are
+// global and survive the CR3 write, a switch within one address space skips it.
+void switch_address_space(address_space_t *as) {
+    if (as == NULL) as = &kernel_address_space;
+    if (as == current_address_space) {
+        paging_stats.cr3_switches_skipped++;
+        return;
+    }
+
+    current_address_space = as;
+    write_cr3((uint32_t)as->page_directory);
+    paging_stats.cr3_switches++;
+}
+
+// Virtual memory regions.
+// A region describes a reserved range of kernel virtual space. Pages in a
+// VM_DEMAND_ZERO region are not mapped up front, the page-fault handler
+// backs each one with a zeroed frame the first time it is touched.
+#define VM_DEMAND_ZERO 0x1
+#define VM_MAX_REGIONS 128
+
+typedef struct vm_region {
+    uint32_t start;     // First byte (page aligned)
+    uint32_t end;       // One past the last byte (page aligned)
+    uint32_t flags;     // VM_* bits
+    const char *name;   // Shown when a fault in the region cannot be resolved
+} vm_region_t;
+
+vm_region_t vm_regions[VM_MAX_REGIONS];  // Sorted by start
+int vm_region_count = 0;
+
+vm_region_t *vm_find_region(uint32_t address) {
+    int low = 0, high = vm_region_count - 1;
+    while (low <= high) {
+        int mid = (low + high) / 2;
+        if (address < vm_regions[mid].start) high = mid - 1;
+        else if (address >= vm_regions[mid].end) low = mid + 1;
+        else return &vm_regions[mid];
+    }
+    return NULL;
+}
+
+vm_region_t *vm_reserve(uint32_t start, uint32_t size, uint32_t flags, const char *name) {
+    uint32_t end = page_align_up(start + size);
+    start = page_align_down(start);
+    if (vm_region_count >= VM_MAX_REGIONS || end <= start) return NULL;
+
+    int i = vm_region_count;
+    while (i > 0 && vm_regions[i - 1].start >= end) {
+        vm_regions[i] = vm_regions[i - 1];
+        i--;
+    }
+    if (i > 0 && vm_regions[i - 1].end > start) {
+        // Overlaps the region below, undo the shift
+        for (; i < vm_region_count; i++) vm_regions[i] = vm_regions[i + 1];
+        return NULL;
+    }
+
+    vm_regions[i] = (vm_region_t){ .start = start, .end = end, .flags = flags, .name = name };
+    vm_region_count++;
+    return &vm_regions[i];
+}
+
+void vm_unreserve(vm_region_t *region) {
+    int i = region - vm_regions;
+    vm_region_count--;
+    for (; i < vm_region_count; i++) vm_regions[i] = vm_regions[i + 1];
+}
+
+// Reserve `size` bytes of demand-zero kernel virtual space
+void *vm_alloc(uint32_t size, const char *name) {
+    size = page_align_up(size);
+    uint32_t candidate = VMALLOC_START;
+
+    // First fit between the regions already inside the window
+    for (int i = 0; i < vm_region_count; i++) {
+        if (vm_regions[i].end <= VMALLOC_START || vm_regions[i].start >= VMALLOC_END) continue;
+        if (vm_regions[i].start - candidate >= size) break;
+        candidate = vm_regions[i].end;
+    }
+    if (VMALLOC_END - candidate < size) return NULL;
+
+    if (vm_reserve(candidate, size, VM_DEMAND_ZERO, name) == NULL) return NULL;
+    return (void *)candidate;
+}
+
+// Release a vm_alloc() range, returning the frames of pages that were touched
+void vm_free(void *ptr) {
+    vm_region_t *region = vm_find_region((uint32_t)ptr);
+    if (region == NULL || region->start != (uint32_t)ptr) return;
+
+    unmap_range(region->start, region->end - region->start, true);
+    vm_unreserve(region);
+}
+
+// Process stacks. Each stack sits directly above an unmapped guard page in
+// the stack window, so running off the bottom is a clean page fault rather
+// than corruption of a neighbour. Freed stacks are pooled by size: the first
+// few keep their frames and are handed out again as they are, the rest give
+// their frames back and only keep the address range.
+#define STACK_MAX_PAGES  16   // Largest stack, 64 KB
+#define STACK_POOL_WARM  4    // Freed stacks per size that stay mapped
+
+typedef struct kstack {
+    uint32_t base;            // Lowest stack byte, the guard page is just below
+    uint32_t pages;           // Mapped size in pages
+    bool mapped;              // Frames are still in place
+    struct kstack *next;      // Next stack in the same pool
+} kstack_t;
+
+static kstack_t *stack_pool_warm[STACK_MAX_PAGES + 1];
+static kstack_t *stack_pool_cold[STACK_MAX_PAGES + 1];
+static uint32_t stack_warm_count[STACK_MAX_PAGES + 1];
+static uint32_t stack_next = STACK_START;  // Bump pointer for new guard + stack slots
+static kmem_cache_t *kstack_cache = NULL;
+
+static bool stack_map(kstack_t *stack) {
+    for (uint32_t i = 0; i < stack->pages; i++) {
+        uint32_t phys_addr = alloc_frame();
+        if (phys_addr == 0) {
+            unmap_range(stack->base, i * PAGE_SIZE, true);
+            return false;
+        }
+        map_page(stack->base + i * PAGE_SIZE, phys_addr, PAGE_RW | PAGE_PRESENT);
+    }
+    stack->mapped = true;
+    return true;
+}
+
+kstack_t *stack_alloc(uint32_t size) {
+    uint32_t pages = page_align_up(size) / PAGE_SIZE;
+    if (pages == 0) pages = 1;
+    if (pages > STACK_MAX_PAGES) return NULL;
+
+    // Fast path: a recently freed stack of the same size, frames and all
+    kstack_t *stack = stack_pool_warm[pages];
+    if (stack) {
+        stack_pool_warm[pages] = stack->next;
+        stack_warm_count[pages]--;
+        return stack;
+    }
+
+    stack = stack_pool_cold[pages];
+    if (stack) {
+        stack_pool_cold[pages] = stack->next;
+    } else {
+        if (kstack_cache == NULL) {
+            // The window is reserved without demand-zero, so guard page hits are reported
+            if (vm_reserve(STACK_START, STACK_END - STACK_START, 0, "process stacks") == NULL) return NULL;
+            kstack_cache = kmem_cache_create("kstack_t", sizeof(kstack_t), 0, NULL);
+            if (kstack_cache == NULL) return NULL;
+        }
+        uint32_t slot = (pages + 1) * PAGE_SIZE;
+        if (STACK_END - stack_next < slot) return NULL;
+
+        stack = (kstack_t *)kmem_cache_alloc(kstack_cache);
+        if (stack == NULL) return NULL;
+        stack->base = stack_next + PAGE_SIZE;
+        stack->pages = pages;
+        stack_next += slot;
+    }
+
+    if (!stack_map(stack)) {
+        stack->mapped = false;
+        stack->next = stack_pool_cold[pages];
+        stack_pool_cold[pages] = stack;
+        return NULL;
+    }
+    return stack;
+}
+
+void stack_free(kstack_t *stack) {
+    if (stack == NULL) return;
+    uint32_t pages = stack->pages;
+
+    if (stack_warm_count[pages] < STACK_POOL_WARM) {
+        stack->next = stack_pool_warm[pages];
+        stack_pool_warm[pages] = stack;
+        stack_warm_count[pages]++;
+        return;
+    }
+
+    unmap_range(stack->base, pages * PAGE_SIZE, true);
+    stack->mapped = false;
+    stack->next = stack_pool_cold[pages];
+    stack_pool_cold[pages] = stack;
+}
+
+// One past the highest stack byte, where a new stack pointer starts
+uint32_t kstack_top(kstack_t *stack) {
+    return stack->base + stack->pages * PAGE_SIZE;
 }
 
 // Example usage: Map 0x1000 (virtual) to 0x2000 (physical)
 void setup_identity_mapping() {
-    for (uint32_t i = 0; i < 16 * 1024 * 1024; i += PAGE_SIZE) { // Map first 16 MB
-        map_page(i, i, 0x3); // Present + RW
-    }
+    map_range(0, 0, 16 * 1024 * 1024, 0x3); // Map first 16 MB, Present + RW
 }
 
-#define HEAP_START 0xC0000000  // Example heap start address
-#define HEAP_SIZE  0x10000    // 1 MB heap size
-#define HEAP_PHY_START 0x001E8480  // 16 MB physical address for heap start
+// Blocks carry their size in a header and a matching footer (boundary tags)
+// so free() can find and merge both physical neighbours in constant time.
+// Free blocks are kept on segregated lists, one per power-of-two size class.
+#define MEM_BLOCK_USED   0x1  // Block is allocated
+#define MEM_BLOCK_LARGE  0x2  // Block is a page run taken straight from the frame allocator
+#define MEM_BLOCK_FLAGS  0x7
+#define MEM_TAG_SIZE     sizeof(size_t)
+#define MEM_MIN_BLOCK    16   // Header + two list links + footer
+#define HEAP_NUM_CLASSES 24   // Class n holds blocks of 2^(n+4) .. 2^(n+5)-1 bytes
+#define HEAP_FIT_SCAN    8    // Blocks to try in the exact class before moving up
+#define HEAP_LARGE_ALLOC (2 * PAGE_SIZE)  // Requests this big bypass the heap
 
 // Memory block header
 typedef struct mem_block {
-    size_t size;             // Size of the block (excluding header)
-    bool free;               // Is this block free?
-    struct mem_block *next;  // Next block in the list
+    size_t size;             // Size of the whole block incl. tags, low bits are MEM_BLOCK_* flags
+    list_node_t node;        // On its size class list (free blocks only)
 } mem_block_t;
 
 static mem_block_t *heap_start = (mem_block_t *)HEAP_START;
-static mem_block_t *heap_end = (mem_block_t *)(HEAP_START + HEAP_SIZE);
+static mem_block_t *heap_end = (mem_block_t *)(HEAP_START + HEAP_INITIAL_SIZE);  // Epilogue header
+static uintptr_t heap_top = HEAP_START;      // End of the mapped heap pages
+static size_t heap_limit = HEAP_MAX_SIZE;    // Ceiling for heap growth, see heap_set_limit()
+static list_node_t heap_classes[HEAP_NUM_CLASSES];
+static uint32_t heap_class_bitmap = 0;  // Bit n set when heap_classes[n] is non-empty
 static bool heap_initialized = false;
 
+static inline size_t block_size(mem_block_t *block) {
+    return block->size & ~MEM_BLOCK_FLAGS;
+}
+
+static inline size_t *block_footer(mem_block_t *block) {
+    return (size_t *)((uintptr_t)block + block_size(block) - MEM_TAG_SIZE);
+}
+
+static inline void set_block(mem_block_t *block, size_t size, size_t flags) {
+    block->size = size | flags;
+    *block_footer(block) = size | flags;
+}
+
+static inline uint32_t size_class(size_t size) {
+    uint32_t class = 31 - __builtin_clz(size) - 4;
+    return class < HEAP_NUM_CLASSES ? class : HEAP_NUM_CLASSES - 1;
+}
+
+static void heap_list_add(mem_block_t *block) {
+    uint32_t class = size_class(block_size(block));
+    list_add_head(&heap_classes[class], &block->node);
+    heap_class_bitmap |= 1u << class;
+}
+
+static void heap_list_remove(mem_block_t *block) {
+    uint32_t class = size_class(block_size(block));
+    list_remove(&block->node);
+    if (list_empty(&heap_classes[class])) heap_class_bitmap &= ~(1u << class);
+}
+
 void init_heap() {
     if (heap_initialized) return;
 
@@ -269,68 +1121,390 @@ void init_heap() {
     //     map_page(addr,addr,0x3);  // Ensure all heap pages are mapped
     // }
 
-    for (uintptr_t addr = HEAP_START, phys_addr = HEAP_PHY_START;
-         addr < HEAP_START + HEAP_SIZE;
-         addr += PAGE_SIZE, phys_addr += PAGE_SIZE) {
-        map_page(addr, phys_addr, 0x3);  // Map virtual to physical (Present + RW)
+    for (uint32_t class = 0; class < HEAP_NUM_CLASSES; class++) {
+        list_init(&heap_classes[class]);
     }
 
-    // Initialize the first memory block
-    heap_start->size = HEAP_SIZE - sizeof(mem_block_t);
-    heap_start->free = true;
-    heap_start->next = NULL;
+    // Reserve the whole heap window, pages get frames when first touched
+    if (vm_reserve(HEAP_START, HEAP_MAX_SIZE, VM_DEMAND_ZERO, "heap") == NULL) return;
+    heap_top = HEAP_START + HEAP_INITIAL_SIZE;
+
+    // Layout: padding, allocated prologue (header + footer), one big free
+    // block, allocated epilogue header. The sentinels stop coalescing at the
+    // edges and keep every payload 8-byte aligned.
+    mem_block_t *prologue = (mem_block_t *)(HEAP_START + MEM_TAG_SIZE);
+    set_block(prologue, 2 * MEM_TAG_SIZE, MEM_BLOCK_USED);
+
+    heap_start = (mem_block_t *)((uintptr_t)prologue + 2 * MEM_TAG_SIZE);
+    heap_end = (mem_block_t *)(heap_top - MEM_TAG_SIZE);
+    heap_end->size = MEM_BLOCK_USED;
+
+    set_block(heap_start, (uintptr_t)heap_end - (uintptr_t)heap_start, 0);
+    heap_list_add(heap_start);
 
     heap_initialized = true;
 }
 
-void *malloc(size_t size) {
-    if (!heap_initialized) init_heap();
+// Cap how far the heap may grow, at most HEAP_MAX_SIZE
+void heap_set_limit(size_t bytes) {
+    heap_limit = bytes < HEAP_MAX_SIZE ? bytes : HEAP_MAX_SIZE;
+}
 
-    mem_block_t *current = heap_start;
+// Extend the heap so a block of `size` bytes fits at the top. The new pages
+// are demand-zero and only take frames once they are written.
+static bool heap_grow(size_t size) {
+    // The old epilogue becomes the header of the new space
+    size_t needed = size;
+    size_t prev_tag = *(size_t *)((uintptr_t)heap_end - MEM_TAG_SIZE);
+    if (!(prev_tag & MEM_BLOCK_USED)) {
+        size_t tail = prev_tag & ~MEM_BLOCK_FLAGS;
+        needed = tail < size ? size - tail : 0;
+    }
+    if (needed < HEAP_GROW_MIN) needed = HEAP_GROW_MIN;
+
+    uintptr_t new_top = page_align_up(heap_top + needed);
+    if (new_top - HEAP_START > heap_limit) new_top = HEAP_START + heap_limit;
+    if (new_top <= heap_top) return false;
+
+    // Refuse growth that could never be backed instead of faulting later
+    if ((new_top - heap_top) / PAGE_SIZE > get_free_frames()) return false;
+    heap_top = new_top;
+
+    mem_block_t *block = heap_end;
+    heap_end = (mem_block_t *)(heap_top - MEM_TAG_SIZE);
+    heap_end->size = MEM_BLOCK_USED;
+
+    // Merge the new space with a free block sitting at the old top
+    size_t block_bytes = (uintptr_t)heap_end - (uintptr_t)block;
+    if (!(prev_tag & MEM_BLOCK_USED)) {
+        block = (mem_block_t *)((uintptr_t)block - (prev_tag & ~MEM_BLOCK_FLAGS));
+        heap_list_remove(block);
+        block_bytes += prev_tag & ~MEM_BLOCK_FLAGS;
+    }
+    set_block(block, block_bytes, 0);
+    heap_list_add(block);
+    return true;
+}
 
-    // Align size to 8 bytes for performance
-    size = (size + 7) & ~7;
+// Give whole free pages at the top of the heap back to the frame allocator
+static void heap_trim(mem_block_t *last) {
+    uintptr_t new_top = page_align_up((uintptr_t)last + MEM_MIN_BLOCK + MEM_TAG_SIZE + HEAP_GROW_MIN);
+    if (new_top < HEAP_START + HEAP_INITIAL_SIZE) new_top = HEAP_START + HEAP_INITIAL_SIZE;
+    if (new_top >= heap_top || heap_top - new_top < HEAP_TRIM_MIN) return;
 
-    // First-fit strategy
-    while (current) {
-        if (current->free && current->size >= size) {
-            // Split the block if there's extra space
-            if (current->size >= size + sizeof(mem_block_t) + 8) {
-                mem_block_t *new_block = (mem_block_t *)((uintptr_t)current + sizeof(mem_block_t) + size);
-                new_block->size = current->size - size - sizeof(mem_block_t);
-                new_block->free = true;
-                new_block->next = current->next;
+    heap_list_remove(last);
+    unmap_range(new_top, heap_top - new_top, true);
+    heap_top = new_top;
 
-                current->size = size;
-                current->next = new_block;
-            }
+    heap_end = (mem_block_t *)(heap_top - MEM_TAG_SIZE);
+    heap_end->size = MEM_BLOCK_USED;
+    set_block(last, (uintptr_t)heap_end - (uintptr_t)last, 0);
+    heap_list_add(last);
+}
+
+// Large requests get their own page run, tagged so free() can hand it back
+static void *malloc_large(size_t size) {
+    uint32_t pages = (size + 2 * MEM_TAG_SIZE + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint32_t order = pages_to_order(pages);
+    uint32_t phys_addr = alloc_frames(order);
+    if (phys_addr == 0) return NULL;
+
+    // Header sits one tag in so the payload stays 8-byte aligned
+    mem_block_t *block = (mem_block_t *)(phys_addr + MEM_TAG_SIZE);
+    block->size = ((size_t)PAGE_SIZE << order) | MEM_BLOCK_USED | MEM_BLOCK_LARGE;
+    return (void *)((uintptr_t)block + MEM_TAG_SIZE);
+}
+
+static mem_block_t *find_free_block(size_t size) {
+    uint32_t class = size_class(size);
+
+    // Blocks in the request's own class may still be too small, try a few
+    int scanned = 0;
+    list_for_each(node, &heap_classes[class]) {
+        if (scanned++ == HEAP_FIT_SCAN) break;
+        mem_block_t *current = list_entry(node, mem_block_t, node);
+        if (block_size(current) >= size) return current;
+    }
+
+    // Any block in a higher class is big enough, take the first one
+    uint32_t higher = heap_class_bitmap & ~((2u << class) - 1);
+    if (class + 1 >= HEAP_NUM_CLASSES || higher == 0) return NULL;
+    return list_entry(heap_classes[__builtin_ctz(higher)].next, mem_block_t, node);
+}
+
+#ifdef HEAP_PROFILE
+// Build with -DHEAP_PROFILE (make EXTRA_CFLAGS=-DHEAP_PROFILE) to record what
+// malloc() and free() are doing. Live allocations sit in an open-addressed
+// table keyed by pointer so free() can charge the bytes back to the call site.
+#define HEAP_PROFILE_LIVE   4096          // Live allocations tracked, power of two
+#define HEAP_PROFILE_SITES  64            // Distinct callers tracked, power of two
+#define HEAP_PROFILE_TOP    10            // Call sites listed by heap_report()
+#define HEAP_PROFILE_DEAD   ((void *)1)   // Deleted slot in heap_live
+
+typedef struct heap_live {
+    void *ptr;
+    size_t size;             // Bytes requested
+    uint32_t site;           // Index into heap_sites, HEAP_PROFILE_SITES if untracked
+} heap_live_t;
+
+typedef struct heap_site {
+    void *caller;            // Return address of the malloc() call
+    size_t live_bytes;
+    uint32_t live_blocks;
+    uint32_t allocs;         // Allocations ever made from here
+} heap_site_t;
+
+typedef struct heap_profile {
+    size_t bytes_in_use;     // Requested bytes of every tracked live block
+    size_t peak_bytes;
+    uint32_t live_blocks;
+    uint32_t allocs;
+    uint32_t frees;
+    uint32_t failed;         // malloc() returned NULL
+    uint32_t large_allocs;   // Served straight from the frame allocator
+    uint32_t untracked;      // Allocations that found the live table full
+    uint32_t histogram[32];  // Allocations by requested size, bucket n is 2^n .. 2^(n+1)-1
+} heap_profile_t;
+
+static heap_profile_t heap_profile;
+static heap_live_t heap_live[HEAP_PROFILE_LIVE];
+static heap_site_t heap_sites[HEAP_PROFILE_SITES];
+
+static inline uint32_t heap_profile_hash(void *ptr) {
+    uintptr_t value = (uintptr_t)ptr;
+    return (value >> 3) ^ (value >> 12);
+}
 
-            current->free = false;
-            return (void *)((uintptr_t)current + sizeof(mem_block_t));
+static uint32_t heap_profile_site(void *caller) {
+    uint32_t i = heap_profile_hash(caller);
+    for (uint32_t n = 0; n < HEAP_PROFILE_SITES; n++, i++) {
+        heap_site_t *site = &heap_sites[i & (HEAP_PROFILE_SITES - 1)];
+        if (site->caller == NULL) site->caller = caller;
+        if (site->caller == caller) return i & (HEAP_PROFILE_SITES - 1);
+    }
+    return HEAP_PROFILE_SITES;
+}
+
+static void heap_profile_alloc(void *ptr, size_t size, void *caller) {
+    if (size == 0) return;
+    if (ptr == NULL) {
+        heap_profile.failed++;
+        return;
+    }
+
+    heap_profile.allocs++;
+    heap_profile.histogram[31 - __builtin_clz(size)]++;
+    if (size >= HEAP_LARGE_ALLOC) heap_profile.large_allocs++;
+
+    uint32_t i = heap_profile_hash(ptr);
+    heap_live_t *slot = NULL;
+    for (uint32_t n = 0; n < HEAP_PROFILE_LIVE; n++, i++) {
+        heap_live_t *candidate = &heap_live[i & (HEAP_PROFILE_LIVE - 1)];
+        if (candidate->ptr == NULL || candidate->ptr == HEAP_PROFILE_DEAD) {
+            slot = candidate;
+            break;
         }
-        current = current->next;
+    }
+    if (slot == NULL) {
+        heap_profile.untracked++;
+        return;
     }
 
-    // No suitable block found
-    return NULL;
+    slot->ptr = ptr;
+    slot->size = size;
+    slot->site = heap_profile_site(caller);
+    if (slot->site < HEAP_PROFILE_SITES) {
+        heap_sites[slot->site].allocs++;
+        heap_sites[slot->site].live_blocks++;
+        heap_sites[slot->site].live_bytes += size;
+    }
+
+    heap_profile.live_blocks++;
+    heap_profile.bytes_in_use += size;
+    if (heap_profile.bytes_in_use > heap_profile.peak_bytes) {
+        heap_profile.peak_bytes = heap_profile.bytes_in_use;
+    }
+}
+
+static void heap_profile_free(void *ptr) {
+    if (ptr == NULL) return;
+    heap_profile.frees++;
+
+    uint32_t i = heap_profile_hash(ptr);
+    for (uint32_t n = 0; n < HEAP_PROFILE_LIVE; n++, i++) {
+        heap_live_t *slot = &heap_live[i & (HEAP_PROFILE_LIVE - 1)];
+        if (slot->ptr == NULL) return;
+        if (slot->ptr != ptr) continue;
+
+        if (slot->site < HEAP_PROFILE_SITES) {
+            heap_sites[slot->site].live_blocks--;
+            heap_sites[slot->site].live_bytes -= slot->size;
+        }
+        heap_profile.live_blocks--;
+        heap_profile.bytes_in_use -= slot->size;
+        slot->ptr = HEAP_PROFILE_DEAD;
+        return;
+    }
+}
+#endif
+
+static void *heap_alloc(size_t size) {
+    if (!heap_initialized) init_heap();
+    if (size == 0) return NULL;
+    if (size >= HEAP_LARGE_ALLOC) return malloc_large(size);
+
+    // Add room for the tags and align size to 8 bytes for performance
+    size = (size + 2 * MEM_TAG_SIZE + 7) & ~7;
+    if (size < MEM_MIN_BLOCK) size = MEM_MIN_BLOCK;
+
+    mem_block_t *block = find_free_block(size);
+    if (!block) {
+        if (!heap_grow(size)) return NULL;  // Heap is at its ceiling or out of frames
+        block = find_free_block(size);
+        if (!block) return NULL;
+    }
+    heap_list_remove(block);
+
+    // Split the block if the tail can stand on its own
+    size_t remaining = block_size(block) - size;
+    if (remaining >= MEM_MIN_BLOCK) {
+        mem_block_t *rest = (mem_block_t *)((uintptr_t)block + size);
+        set_block(rest, remaining, 0);
+        heap_list_add(rest);
+    } else {
+        size = block_size(block);
+    }
+
+    set_block(block, size, MEM_BLOCK_USED);
+    return (void *)((uintptr_t)block + MEM_TAG_SIZE);
+}
+
+// The heap is only touched with interrupts off, so a task preempted in
+// malloc() or free() never leaves the free lists half updated
+void *malloc(size_t size) {
+    uint32_t flags = irq_save();
+    void *ptr = heap_alloc(size);
+#ifdef HEAP_PROFILE
+    heap_profile_alloc(ptr, size, __builtin_return_address(0));
+#endif
+    irq_restore(flags);
+    return ptr;
+}
+
+static void heap_free(void *ptr) {
+#ifdef HEAP_PROFILE
+    heap_profile_free(ptr);
+#endif
+
+    mem_block_t *block = (mem_block_t *)((uintptr_t)ptr - MEM_TAG_SIZE);
+    if (block->size & MEM_BLOCK_LARGE) {
+        free_frames(page_align_down((uint32_t)block));
+        return;
+    }
+
+    size_t size = block_size(block);
+
+    // Coalesce with the following block
+    mem_block_t *next = (mem_block_t *)((uintptr_t)block + size);
+    if (!(next->size & MEM_BLOCK_USED)) {
+        heap_list_remove(next);
+        size += block_size(next);
+    }
+
+    // Coalesce with the preceding block, found through its footer
+    size_t prev_tag = *(size_t *)((uintptr_t)block - MEM_TAG_SIZE);
+    if (!(prev_tag & MEM_BLOCK_USED)) {
+        mem_block_t *prev = (mem_block_t *)((uintptr_t)block - (prev_tag & ~MEM_BLOCK_FLAGS));
+        heap_list_remove(prev);
+        size += prev_tag & ~MEM_BLOCK_FLAGS;
+        block = prev;
+    }
+
+    set_block(block, size, 0);
+    heap_list_add(block);
+
+    if ((uintptr_t)block + size == (uintptr_t)heap_end) {
+        heap_trim(block);
+    }
 }
 
 void free(void *ptr) {
     if (!ptr) return;
 
-    mem_block_t *block = (mem_block_t *)((uintptr_t)ptr - sizeof(mem_block_t));
-    block->free = true;
+    uint32_t flags = irq_save();
+    heap_free(ptr);
+    irq_restore(flags);
+}
 
-    // Coalesce adjacent free blocks
-    mem_block_t *current = heap_start;
-    while (current) {
-        if (current->free && current->next && current->next->free) {
-            current->size += sizeof(mem_block_t) + current->next->size;
-            current->next = current->next->next;
+// part * 100 / whole without overflowing 32 bits for sizes up to the heap window
+static inline uint32_t heap_percent(size_t part, size_t whole) {
+    if (whole == 0) return 0;
+    if (whole > 0x1000000) return (part >> 8) * 100 / (whole >> 8);
+    return part * 100 / whole;
+}
+
+// Walk the heap and print its shape. Fragmentation is the share of free
+// bytes that sit outside the largest free block. Builds with HEAP_PROFILE
+// add the size histogram, peak usage and the call sites holding most bytes.
+// Press F11 for one at any time: malloc() and free() run with interrupts
+// off, so the keyboard interrupt always finds the heap consistent.
+void heap_report() {
+    if (!heap_initialized) init_heap();
+
+    uint32_t used_blocks = 0, free_blocks = 0;
+    size_t used_bytes = 0, free_bytes = 0, largest_free = 0;
+    for (mem_block_t *block = heap_start; block < heap_end;
+         block = (mem_block_t *)((uintptr_t)block + block_size(block))) {
+        size_t size = block_size(block);
+        if (block->size & MEM_BLOCK_USED) {
+            used_blocks++;
+            used_bytes += size;
         } else {
-            current = current->next;
+            free_blocks++;
+            free_bytes += size;
+            if (size > largest_free) largest_free = size;
+        }
+    }
+
+    printf("Heap: %d KB mapped, %d KB limit\n", (heap_top - HEAP_START) / 1024, heap_limit / 1024);
+    printf("  %d used blocks (%d bytes), %d free blocks (%d bytes)\n",
+           used_blocks, used_bytes, free_blocks, free_bytes);
+    printf("  largest free block %d bytes, %d%% fragmentation\n",
+           largest_free, free_bytes ? 100 - heap_percent(largest_free, free_bytes) : 0);
+
+#ifdef HEAP_PROFILE
+    printf("  %d allocs, %d frees, %d failed, %d large, %d untracked\n",
+           heap_profile.allocs, heap_profile.frees, heap_profile.failed,
+           heap_profile.large_allocs, heap_profile.untracked);
+    printf("  %d bytes live in %d blocks, peak %d bytes\n",
+           heap_profile.bytes_in_use, heap_profile.live_blocks, heap_profile.peak_bytes);
+
+    printf("  Request sizes:\n");
+    for (uint32_t n = 0; n < 31; n++) {
+        if (heap_profile.histogram[n] == 0) continue;
+        printf("    %d-%d bytes: %d\n", 1u << n, (2u << n) - 1, heap_profile.histogram[n]);
+    }
+
+    // Heaviest call sites first, selection over the small site table
+    uint32_t order[HEAP_PROFILE_SITES];
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < HEAP_PROFILE_SITES; i++) {
+        if (heap_sites[i].caller == NULL) continue;
+        uint32_t j = count++;
+        while (j > 0 && heap_sites[order[j - 1]].live_bytes < heap_sites[i].live_bytes) {
+            order[j] = order[j - 1];
+            j--;
         }
+        order[j] = i;
     }
+
+    printf("  Live bytes by call site:\n");
+    for (uint32_t i = 0; i < count && i < HEAP_PROFILE_TOP; i++) {
+        heap_site_t *site = &heap_sites[order[i]];
+        printf("    %x: %d bytes in %d blocks, %d allocs\n",
+               (uint32_t)site->caller, site->live_bytes, site->live_blocks, site->allocs);
+    }
+#endif
 }
 
 
@@ -374,61 +1548,122 @@ __attribute__((interrupt)) void isr_dummy(struct interrupt_frame* frame) {
 }
 #pragma GCC reset_options
 
-#pragma GCC target("general-regs-only")
-__attribute__((interrupt)) void isr80_handler(struct interrupt_frame* frame) {
-   puts("Interrupt 0x80 Handler.............................................done\n");
-   outb(0x20, 0x20);  
-   outb(0xA0, 0x20); 
-}
-#pragma GCC reset_options
+// Page fault error code bits
+#define PF_PRESENT 0x1  // Fault on a present page (protection violation)
+#define PF_WRITE   0x2  // Faulting access was a write
+#define PF_USER    0x4  // Fault happened in user mode
 
-#pragma GCC target("general-regs-only")
-__attribute__((interrupt)) void PIT_handler(struct interrupt_frame* frame) {
-   //
-    //printf("PIT interrupt occurred!\n");
+typedef unsigned int uword_t __attribute__((mode(__word__)));
 
-        if (current_process == NULL || current_process->state != RUNNING) {
-        outb(0x20, 0x20); // Acknowledge EOI before returning
-        return; // No process to switch
+static inline uint32_t read_cr2() {
+    uint32_t address;
+    __asm__ __volatile__("movl %%cr2, %0" : "=r"(address));
+    return address;
+}
+
+// Try to resolve a fault, returns false if it is a genuine bad access
+bool handle_page_fault(uint32_t address, uint32_t error_code) {
+    if ((error_code & PF_PRESENT) && (error_code & PF_WRITE) && handle_cow_fault(address)) {
+        return true;
     }
 
-    // Save the current process's state
-    asm volatile (
-        "pusha\n\t"                      // Save all general-purpose registers
-        "movl %%esp, %0\n\t"             // Save ESP to current_process->stack_pointer
-        : "=m"(current_process->stack_pointer)
-        :
-        : "memory"
-    );
+    vm_region_t *region = vm_find_region(address);
+    if (region == NULL) return false;
 
-    // Find the next process in the ready queue
-    process_t *next_process = current_process->next;
-    if (next_process == NULL) {
-        next_process = ready_queue; // Loop back to the start of the queue
+    if (!(error_code & PF_PRESENT) && (region->flags & VM_DEMAND_ZERO)) {
+        uint32_t phys_addr = alloc_frames_flags(0, ALLOC_ZEROED);
+        if (phys_addr == 0) return false;
+        map_page(page_align_down(address), phys_addr, PAGE_RW | PAGE_PRESENT);
+        return true;
+    }
+    return false;
+}
+
+#pragma GCC target("general-regs-only")
+__attribute__((interrupt)) void page_fault_handler(struct interrupt_frame* frame, uword_t error_code) {
+    uint32_t address = read_cr2();
+    if (handle_page_fault(address, error_code)) return;
+
+    // GCC hands interrupt functions a pointer to the EIP/CS/EFLAGS pushed by the CPU
+    uint32_t eip = *(uint32_t *)frame;
+    vm_region_t *region = vm_find_region(address);
+    printf("\nPAGE FAULT at %x (error %x, eip %x) in %s\n",
+           address, error_code, eip, region ? region->name : "unmapped memory");
+    if (address >= STACK_START && address < STACK_END && !(error_code & PF_PRESENT)) {
+        printf("Stack overflow into a guard page\n");
+    }
+    klog_dump();
+    for (;;) {
+        __asm__ __volatile__("cli; hlt");
     }
+}
+#pragma GCC reset_options
 
-    // Switch to the next process
-    current_process = next_process;
-    if (current_process) {
-        current_process->state = RUNNING;
+// A fault while pushing the page fault frame (ESP already in a guard page) escalates to a
+// double fault, which can't be delivered on the same stack either. Vector 8 is a task gate
+// instead, so the CPU saves the faulting state into kernel_tss and runs this on its own stack.
+__attribute__((aligned(16))) static uint8_t double_fault_stack[PAGE_SIZE];
 
-        // Restore the next process's state
-        asm volatile (
-            "movl %0, %%esp\n\t"         // Load ESP with next_process->stack_pointer
-            "popa\n\t"                   // Restore all general-purpose registers
-            :
-            : "m"(current_process->stack_pointer)
-            : "memory"
-        );
+#pragma GCC target("general-regs-only")
+__attribute__((noreturn)) void double_fault_task() {
+    uint32_t address = read_cr2();
+    printf("\nDOUBLE FAULT (eip %x, esp %x, cr2 %x)\n", kernel_tss.eip, kernel_tss.esp, address);
+    if ((kernel_tss.esp >= STACK_START && kernel_tss.esp < STACK_END) ||
+        (address >= STACK_START && address < STACK_END)) {
+        printf("Stack overflow into a guard page");
+        if (current_process != NULL) printf(" in pid %d", current_process->pid);
+        printf("\n");
     }
+    klog_dump();
+    for (;;) {
+        __asm__ __volatile__("cli; hlt");
+    }
+}
+#pragma GCC reset_options
 
-    // Acknowledge the End of Interrupt
-    outb(0x20, 0x20); // Send EOI to the master PIC
+static void setup_double_fault_task() {
+    double_fault_tss = (struct TSS){
+        .cr3 = (uint32_t)page_directory,
+        .eip = (uint32_t)double_fault_task,
+        .eflags = 0x2,   // Interrupts stay off
+        .esp = (uint32_t)double_fault_stack + sizeof(double_fault_stack),
+        .cs = 0x08,
+        .ds = 0x10, .es = 0x10, .fs = 0x10, .gs = 0x10, .ss = 0x10,
+        .iomap_base = sizeof(struct TSS)
+    };
+    idt[0x08].offset_low = 0;
+    idt[0x08].offset_high = 0;
+    idt[0x08].selector = DOUBLE_FAULT_TSS_SELECTOR;
+    idt[0x08].zero = 0;
+    idt[0x08].attributes = 0x85; // Task gate, present, ring 0
+}
 
-    printf("Returning from interrupt after ACK\n");
+#pragma GCC target("general-regs-only")
+__attribute__((interrupt)) void isr80_handler(struct interrupt_frame* frame) {
+   klog(KLOG_INFO, "Interrupt 0x80 handled");
+   outb(0x20, 0x20);  
+   outb(0xA0, 0x20); 
+}
+#pragma GCC reset_options
 
-    // Return from interrupt
-    asm volatile ("iret");
+#pragma GCC target("general-regs-only")
+// C side of the assembly entry stubs in asm.s. A task switch in here
+// returns into another task's trap_dispatch() (or task_entry), and the
+// frame that is popped and iret'd to is that task's.
+void trap_dispatch(trap_frame_t *frame) {
+    uint64_t start = rdtsc();
+
+    switch (frame->vector) {
+    case 0x20:
+        // EOI first, after a switch this path only continues once we run again
+        outb(0x20, 0x20);
+        if (sched_timer(timer_expired())) sched_preempt(start);
+        break;
+    case LAPIC_TIMER_VECTOR:
+        lapic_eoi();
+        if (sched_timer(timer_expired())) sched_preempt(start);
+        break;
+    }
 }
 #pragma GCC reset_options
 
@@ -470,6 +1705,14 @@ __attribute__((interrupt)) void keyboard_handler(struct interrupt_frame* frame)
     } else if (scancode == 0xAA || scancode == 0xB6) {  // Left or Right Shift released
         shift_pressed = 0;
         // No printing, just return to avoid processing Shift itself
+    } else if (scancode == 0x49) {  // Page Up: look back through the console history
+        console_scroll_view(TEXT_SCREEN_HEIGHT / 2);
+    } else if (scancode == 0x51) {  // Page Down
+        console_scroll_view(-(TEXT_SCREEN_HEIGHT / 2));
+    } else if (scancode == 0x57) {  // F11: heap report, taken whatever is running
+        heap_report();
+    } else if (scancode == 0x58) {  // F12: replay the kernel log
+        klog_dump();
     } else if (scancode < 128) {
         // If the key is pressed (not released) and valid
         char key = (shift_pressed) ? scancode_to_ascii_shift[scancode] : scancode_to_ascii[scancode];
@@ -506,9 +1749,13 @@ void setup_idt() {
         idt[i].offset_high = (isr_address >> 16) & 0xFFFF;
     }
 
+    set_idt_entry(0x07, fpu_nm_handler);
+    setup_double_fault_task();
+    set_idt_entry(0x0E, page_fault_handler);
     set_idt_entry(0x80, isr80_handler);
-    set_idt_entry(0x20,PIT_handler);
+    set_idt_entry(0x20,irq0_entry);
     set_idt_entry(0x21,keyboard_handler);
+    set_idt_entry(COM1_VECTOR, serial_handler);
     // IDTR setup
     idt_ptr.limit = sizeof(idt) - 1;
     idt_ptr.base = (uint32_t)&idt;
@@ -561,7 +1808,7 @@ void setup_PIC()
     outb(0xA1, 0x01); // Slave PIC in 8086 mode
 
     // Mask interrupts
-    outb(0x21, 0xFC); // Unmask IRQ0 and IRQ1, mask others
+    outb(0x21, 0xEC); // Unmask IRQ0, IRQ1 and IRQ4 (COM1), mask others
     outb(0xA1, 0xFF); // Mask all interrupts on Slave PIC
 }
 
@@ -569,12 +1816,9 @@ void setup_PIT()
 {
     //PIT IRQ0 IVT number 0x20 (32d)
     //IRQ1 IVT number 0x21 (33d)
-    uint16_t divisor = 1193180 / 100;
-    // Set PIT to rate generator mode on channel 0.
-    outb(0x43,0x36); // 00 11 0110: Channel 0, lobyte/hibyte, rate generator.
-    //Set the divider for 100 Hz. Divider 11932 = 1193182/frequncy
-    outb(0x40,divisor & 0xFF); // Low byte of frequency divider 11932 .
-    outb(0x40,(divisor >> 8) & 0xFF); // High byte of frequency divider 11932.
+    // Channel 0 in one-shot mode and stopped. init_timer() decides whether
+    // it or the local APIC timer is armed for scheduler deadlines.
+    timer_program(TIMER_NEVER);
 }
 
 #define MAX_VENDOR_ID_LEN 13
@@ -588,15 +1832,6 @@ typedef struct {
     uint32_t cache_size_kb;       // Cache size (in KB)
 } hardware_info_t;
 
-// Function to invoke CPUID instruction
-static void cpuid(uint32_t eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx, uint32_t *eax_out) {
-    __asm__ (
-        "cpuid"
-        : "=a"(*eax_out), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
-        : "a"(eax)
-    );
-}
-
 // Function to retrieve hardware info
 hardware_info_t hardware_info() {
     hardware_info_t info = {0};
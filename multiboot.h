@@ -0,0 +1,67 @@
+#ifndef MULTIBOOT_H
+#define MULTIBOOT_H
+
+#include <stdint.h>
+
+#define MULTIBOOT_INFO_MEMORY  (1 << 0)  // mem_lower/mem_upper are valid
+#define MULTIBOOT_INFO_MMAP    (1 << 6)  // mmap_addr/mmap_length are valid
+#define MULTIBOOT_INFO_FRAMEBUFFER (1 << 12)  // framebuffer_* fields are valid
+
+#define MULTIBOOT_MEMORY_AVAILABLE 1
+
+#define MULTIBOOT_FRAMEBUFFER_TYPE_INDEXED 0
+#define MULTIBOOT_FRAMEBUFFER_TYPE_RGB     1
+#define MULTIBOOT_FRAMEBUFFER_TYPE_TEXT    2
+
+//Multiboot 1 Memory info structure
+struct multiboot_mmap_entry
+{
+    uint32_t flags;          // Flags to indicate which information is available
+    uint32_t mem_lower;      // Lower memory size in KB
+    uint32_t mem_upper;      // Upper memory size in KB
+    uint32_t boot_device;    // Boot device (as specified by the bootloader)
+    uint32_t cmdline;        // Command line passed to the kernel (if any)
+    uint32_t mods_count;     // Number of modules loaded by the bootloader
+    uint32_t mods_addr;      // Address of the modules (if mods_count > 0)
+    uint32_t syms[4];         // a.out symbol table or ELF section headers (if provided)
+    uint32_t mmap_length;     // Length of the memory map (if provided)
+    uint32_t mmap_addr;       // Memory map address (if provided)
+    uint32_t drives_length;   // Length of the drives (if provided)
+    uint32_t drives_addr;     // Drives address (if provided)
+    uint32_t config_table;    // Configuration table address (if provided)
+    uint32_t boot_loader_name; // Boot loader name string address (if provided)
+    uint32_t apm_table;       // APM table address (if available)
+    uint32_t vbe_control_info; // VBE control info address (if provided)
+    uint32_t vbe_mode_info;   // VBE mode info address (if provided)
+    uint16_t vbe_mode;        // VBE mode (if available)
+    uint16_t vbe_interface_seg; // VBE interface segment (if available)
+    uint16_t vbe_interface_off; // VBE interface offset (if available)
+    uint16_t vbe_interface_len; // VBE interface length (if available)
+    uint64_t framebuffer_addr;  // Physical address of the framebuffer (if provided)
+    uint32_t framebuffer_pitch; // Bytes per scanline
+    uint32_t framebuffer_width; // In pixels, or characters for EGA text
+    uint32_t framebuffer_height;
+    uint8_t framebuffer_bpp;    // Bits per pixel
+    uint8_t framebuffer_type;   // MULTIBOOT_FRAMEBUFFER_TYPE_*
+    uint8_t framebuffer_red_field_position;   // Colour layout, for RGB framebuffers
+    uint8_t framebuffer_red_mask_size;
+    uint8_t framebuffer_green_field_position;
+    uint8_t framebuffer_green_mask_size;
+    uint8_t framebuffer_blue_field_position;
+    uint8_t framebuffer_blue_mask_size;
+} __attribute__((packed));
+
+typedef struct multiboot_mmap_entry multiboot_memory_map_t;
+
+// One record of the BIOS (e820) memory map pointed to by mmap_addr.
+// `size` does not count itself, so the next record is at +size+4.
+typedef struct multiboot_memory_region {
+    uint32_t size;           // Size of the rest of this record
+    uint64_t addr;           // Physical start address
+    uint64_t len;            // Length in bytes
+    uint32_t type;           // 1 = available RAM, anything else is reserved
+} __attribute__((packed)) multiboot_memory_region_t;
+
+extern multiboot_memory_map_t *boot_info;
+
+#endif
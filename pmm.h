@@ -0,0 +1,451 @@
+#ifndef PMM_H
+#define PMM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "multiboot.h"
+#include "vga.h"
+#include "x86.h"
+#include "list.h"
+
+// Physical frame allocator.
+// Usable RAM comes from the multiboot memory map and is handed out as
+// power-of-two runs of 4 KB frames by a binary buddy allocator.
+// Allocation and free are O(log n) in the number of orders.
+
+#define PAGE_SIZE      4096
+#define PAGE_SHIFT     12
+#define PMM_MAX_ORDER  10        // Largest block is 2^10 frames (4 MB)
+
+#define FRAME_FREE     (1 << 0)  // Frame heads a block sitting in a free list
+#define FRAME_RESERVED (1 << 1)  // Frame is never handed out (kernel, BIOS, holes)
+
+#define PMM_MAX_ADDRESS  0x40000000  // RAM above this is not identity mapped (user space starts)
+#define PMM_MAX_RANGES   32
+#define PMM_MAX_RESERVED 16
+
+#define ALLOC_ZEROED     (1 << 0)  // alloc_frames_flags(): frames must read as zero
+
+#define PMM_ZERO_POOL_SIZE 64      // Pre-zeroed frames kept ready for ALLOC_ZEROED
+#define PMM_ZERO_BATCH     4       // Frames zeroed per scheduler idle pass
+
+// Provided by linker.ld, bracket the loaded kernel image
+extern char kernel_start[];
+extern char kernel_end[];
+
+// Per-frame bookkeeping, only meaningful for the first frame of a block
+typedef struct page_frame {
+    uint8_t order;      // Order of the block this frame heads
+    uint8_t flags;      // FRAME_* bits
+    uint16_t ref_count; // Mappings sharing this block (copy-on-write), 0 while free
+} page_frame_t;
+
+typedef struct free_area {
+    list_node_t blocks;  // Free blocks, linked through their own first bytes (RAM is identity mapped)
+    uint32_t nr_free;    // Free blocks of this order
+    uint32_t nr_used;    // Allocated blocks of this order
+} free_area_t;
+
+typedef struct phys_range {
+    uint32_t start;      // First byte (page aligned)
+    uint32_t end;        // One past the last byte (page aligned)
+} phys_range_t;
+
+static page_frame_t *frame_map = NULL;   // One entry per physical frame
+static uint32_t frame_count = 0;         // Frames covered by frame_map
+static uint32_t total_frames = 0;        // Frames handed to the allocator at boot
+static uint32_t free_frames_count = 0;   // Frames currently free
+static free_area_t free_area[PMM_MAX_ORDER + 1];
+
+// Frames zeroed ahead of time, at boot and whenever the scheduler idles.
+// They count as free.
+static uint32_t zero_pool[PMM_ZERO_POOL_SIZE];
+static uint32_t zero_pool_count = 0;
+static uint32_t zero_pool_hits = 0;      // ALLOC_ZEROED served from the pool
+static uint32_t zero_pool_misses = 0;    // ALLOC_ZEROED that had to zero inline
+static bool zero_use_movnti = false;     // SSE2 non-temporal stores available
+
+bool pmm_refill_zero_pool(uint32_t budget);
+
+static phys_range_t ram_ranges[PMM_MAX_RANGES];
+static int ram_range_count = 0;
+static phys_range_t reserved_ranges[PMM_MAX_RESERVED];  // Sorted by start
+static int reserved_range_count = 0;
+
+static inline uint32_t page_align_down(uint32_t addr) {
+    return addr & ~(PAGE_SIZE - 1);
+}
+
+static inline uint32_t page_align_up(uint32_t addr) {
+    return (addr + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+}
+
+// Smallest order whose block holds `pages` frames
+static inline uint32_t pages_to_order(uint32_t pages) {
+    uint32_t order = 0;
+    while ((1u << order) < pages) order++;
+    return order;
+}
+
+static void pmm_add_ram(uint64_t start, uint64_t end) {
+    if (start >= 0x100000000ULL || ram_range_count >= PMM_MAX_RANGES) return;
+    if (end > PMM_MAX_ADDRESS) end = PMM_MAX_ADDRESS;  // Frames must stay identity mapped
+
+    uint32_t s = page_align_up((uint32_t)start);
+    uint32_t e = page_align_down((uint32_t)end);
+    if (s >= e) return;
+
+    ram_ranges[ram_range_count].start = s;
+    ram_ranges[ram_range_count].end = e;
+    ram_range_count++;
+}
+
+void pmm_reserve(uint32_t start, uint32_t end) {
+    if (reserved_range_count >= PMM_MAX_RESERVED || start >= end) return;
+    start = page_align_down(start);
+    end = page_align_up(end);
+
+    // Insertion keeps the list sorted so carving is a single forward walk
+    int i = reserved_range_count++;
+    while (i > 0 && reserved_ranges[i - 1].start > start) {
+        reserved_ranges[i] = reserved_ranges[i - 1];
+        i--;
+    }
+    reserved_ranges[i].start = start;
+    reserved_ranges[i].end = end;
+}
+
+// Collect available RAM from the multiboot memory map
+static void pmm_read_memory_map() {
+    if (boot_info->flags & MULTIBOOT_INFO_MMAP) {
+        uint32_t addr = boot_info->mmap_addr;
+        uint32_t end = boot_info->mmap_addr + boot_info->mmap_length;
+        while (addr < end) {
+            multiboot_memory_region_t *region = (multiboot_memory_region_t *)addr;
+            if (region->type == MULTIBOOT_MEMORY_AVAILABLE) {
+                pmm_add_ram(region->addr, region->addr + region->len);
+            }
+            addr += region->size + sizeof(region->size);
+        }
+    } else if (boot_info->flags & MULTIBOOT_INFO_MEMORY) {
+        // No map, fall back to the conventional and extended memory sizes
+        pmm_add_ram(0, (uint64_t)boot_info->mem_lower * 1024);
+        pmm_add_ram(0x100000, 0x100000 + (uint64_t)boot_info->mem_upper * 1024);
+    }
+}
+
+static void pmm_list_add(uint32_t pfn, uint32_t order) {
+    list_add_head(&free_area[order].blocks, (list_node_t *)(pfn << PAGE_SHIFT));
+    free_area[order].nr_free++;
+
+    frame_map[pfn].order = order;
+    frame_map[pfn].flags = FRAME_FREE;
+}
+
+static void pmm_list_remove(uint32_t pfn, uint32_t order) {
+    list_remove((list_node_t *)(pfn << PAGE_SHIFT));
+    free_area[order].nr_free--;
+
+    frame_map[pfn].flags &= ~FRAME_FREE;
+}
+
+// Put a block back, merging with its buddy for as long as the buddy is free
+static void pmm_release_block(uint32_t pfn, uint32_t order) {
+    while (order < PMM_MAX_ORDER) {
+        uint32_t buddy = pfn ^ (1u << order);
+        if (buddy >= frame_count) break;
+        if (!(frame_map[buddy].flags & FRAME_FREE) || frame_map[buddy].order != order) break;
+
+        pmm_list_remove(buddy, order);
+        pfn &= ~(1u << order);
+        order++;
+    }
+    pmm_list_add(pfn, order);
+}
+
+// Hand [pfn, end) to the allocator as the largest aligned blocks that fit
+static void pmm_free_range(uint32_t pfn, uint32_t end) {
+    while (pfn < end) {
+        uint32_t order = PMM_MAX_ORDER;
+        while (order > 0 && ((pfn & ((1u << order) - 1)) || pfn + (1u << order) > end)) {
+            order--;
+        }
+        pmm_release_block(pfn, order);
+        free_frames_count += 1u << order;
+        total_frames += 1u << order;
+        pfn += 1u << order;
+    }
+}
+
+// Find `size` bytes of RAM that do not overlap anything reserved
+static uint32_t pmm_find_free_run(uint32_t size) {
+    for (int i = 0; i < ram_range_count; i++) {
+        uint32_t candidate = ram_ranges[i].start;
+        bool moved = true;
+        while (moved) {
+            moved = false;
+            for (int r = 0; r < reserved_range_count; r++) {
+                if (reserved_ranges[r].start < candidate + size && reserved_ranges[r].end > candidate) {
+                    candidate = reserved_ranges[r].end;
+                    moved = true;
+                }
+            }
+        }
+        if (candidate + size <= ram_ranges[i].end && candidate + size > candidate) {
+            return candidate;
+        }
+    }
+    return 0;
+}
+
+void init_frame_allocator() {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &ebx, &ecx, &edx, &eax);
+    zero_use_movnti = (edx & CPUID_EDX_SSE2) != 0;
+
+    for (uint32_t order = 0; order <= PMM_MAX_ORDER; order++) {
+        list_init(&free_area[order].blocks);
+    }
+    pmm_read_memory_map();
+
+    // Keep the real-mode IVT/BDA, the VGA/BIOS hole, the kernel and boot data
+    pmm_reserve(0, PAGE_SIZE);
+    pmm_reserve(0xA0000, 0x100000);  // Includes text video memory at 0xB8000
+    pmm_reserve((uint32_t)kernel_start, (uint32_t)kernel_end);
+    pmm_reserve((uint32_t)boot_info, (uint32_t)boot_info + sizeof(multiboot_memory_map_t));
+    if (boot_info->flags & MULTIBOOT_INFO_MMAP) {
+        pmm_reserve(boot_info->mmap_addr, boot_info->mmap_addr + boot_info->mmap_length);
+    }
+
+    uint32_t top = 0;
+    for (int i = 0; i < ram_range_count; i++) {
+        if (ram_ranges[i].end > top) top = ram_ranges[i].end;
+    }
+    frame_count = top >> PAGE_SHIFT;
+
+    // Frame map lives in the first free RAM that can hold it
+    uint32_t map_size = page_align_up(frame_count * sizeof(page_frame_t));
+    uint32_t map_addr = pmm_find_free_run(map_size);
+    if (map_addr == 0) {
+        frame_count = 0;
+        return;
+    }
+    pmm_reserve(map_addr, map_addr + map_size);
+    frame_map = (page_frame_t *)map_addr;
+    for (uint32_t pfn = 0; pfn < frame_count; pfn++) {
+        frame_map[pfn].order = 0;
+        frame_map[pfn].flags = FRAME_RESERVED;
+        frame_map[pfn].ref_count = 0;
+    }
+
+    // Release every available range minus the reserved holes
+    for (int i = 0; i < ram_range_count; i++) {
+        uint32_t start = ram_ranges[i].start;
+        uint32_t end = ram_ranges[i].end;
+        for (int r = 0; r < reserved_range_count && start < end; r++) {
+            if (reserved_ranges[r].end <= start || reserved_ranges[r].start >= end) continue;
+            if (reserved_ranges[r].start > start) {
+                pmm_free_range(start >> PAGE_SHIFT, reserved_ranges[r].start >> PAGE_SHIFT);
+            }
+            start = reserved_ranges[r].end;
+        }
+        if (start < end) {
+            pmm_free_range(start >> PAGE_SHIFT, end >> PAGE_SHIFT);
+        }
+    }
+
+    // The first tasks fault pages in before the CPU has ever been idle
+    pmm_refill_zero_pool(PMM_ZERO_POOL_SIZE);
+}
+
+// Take 2^order contiguous frames from the buddy lists
+static uint32_t pmm_alloc_block(uint32_t order) {
+    if (order > PMM_MAX_ORDER) return 0;
+
+    uint32_t current = order;
+    while (current <= PMM_MAX_ORDER && list_empty(&free_area[current].blocks)) current++;
+    if (current > PMM_MAX_ORDER) return 0;
+
+    uint32_t pfn = (uint32_t)list_first(&free_area[current].blocks) >> PAGE_SHIFT;
+    pmm_list_remove(pfn, current);
+
+    // Split down to the requested order, returning upper halves
+    while (current > order) {
+        current--;
+        pmm_list_add(pfn + (1u << current), current);
+    }
+
+    frame_map[pfn].order = order;
+    frame_map[pfn].flags = 0;
+    frame_map[pfn].ref_count = 1;
+    free_area[order].nr_used++;
+    free_frames_count -= 1u << order;
+
+    return pfn << PAGE_SHIFT;
+}
+
+// Zero whole frames. Non-temporal stores bypass the cache so pool refills
+// do not evict the working set of whatever runs next.
+static void zero_frames(uint32_t addr, uint32_t order) {
+    uint32_t count = (PAGE_SIZE << order) / 16;
+    if (zero_use_movnti) {
+        __asm__ __volatile__(
+            "1:\n\t"
+            "movnti %%eax, 0(%0)\n\t"
+            "movnti %%eax, 4(%0)\n\t"
+            "movnti %%eax, 8(%0)\n\t"
+            "movnti %%eax, 12(%0)\n\t"
+            "addl $16, %0\n\t"
+            "decl %1\n\t"
+            "jnz 1b\n\t"
+            "sfence\n\t"
+            : "+r"(addr), "+r"(count)
+            : "a"(0)
+            : "memory"
+        );
+    } else {
+        __asm__ __volatile__(
+            "rep stosl"
+            : "+D"(addr), "+c"(count)
+            : "a"(0)
+            : "memory"
+        );
+    }
+}
+
+// Give the pooled frames back so larger blocks can merge again
+static void pmm_drain_zero_pool() {
+    while (zero_pool_count) {
+        uint32_t addr = zero_pool[--zero_pool_count];
+        uint32_t pfn = addr >> PAGE_SHIFT;
+        frame_map[pfn].ref_count = 0;
+        free_area[0].nr_used--;
+        free_frames_count++;
+        pmm_release_block(pfn, 0);
+    }
+}
+
+static uint32_t pmm_alloc_frames(uint32_t order, uint32_t flags) {
+    if (order == 0 && (flags & ALLOC_ZEROED) && zero_pool_count) {
+        zero_pool_hits++;
+        return zero_pool[--zero_pool_count];
+    }
+
+    uint32_t addr = pmm_alloc_block(order);
+    if (addr == 0 && zero_pool_count) {
+        // Pooled frames are free memory too, use them before failing
+        if (order == 0) return zero_pool[--zero_pool_count];
+        pmm_drain_zero_pool();
+        addr = pmm_alloc_block(order);
+    }
+
+    if (addr && (flags & ALLOC_ZEROED)) {
+        zero_pool_misses++;
+        zero_frames(addr, order);
+    }
+    return addr;
+}
+
+// Allocate 2^order contiguous frames, returns the physical address or 0.
+// With ALLOC_ZEROED single frames come from the pre-zeroed pool when possible.
+uint32_t alloc_frames_flags(uint32_t order, uint32_t flags) {
+    uint32_t irq_flags = irq_save();
+    uint32_t addr = pmm_alloc_frames(order, flags);
+    irq_restore(irq_flags);
+    return addr;
+}
+
+uint32_t alloc_frames(uint32_t order) {
+    return alloc_frames_flags(order, 0);
+}
+
+// Zero up to `budget` more frames into the pool. Called from the scheduler's
+// idle path, returns false once the pool is full (or memory ran out) so it
+// can halt.
+bool pmm_refill_zero_pool(uint32_t budget) {
+    while (budget-- && zero_pool_count < PMM_ZERO_POOL_SIZE) {
+        uint32_t flags = irq_save();
+        uint32_t addr = pmm_alloc_block(0);
+        irq_restore(flags);
+        if (addr == 0) return false;
+
+        // Zeroed with interrupts on, only this loop ever adds to the pool
+        zero_frames(addr, 0);
+        flags = irq_save();
+        zero_pool[zero_pool_count++] = addr;
+        irq_restore(flags);
+    }
+    return zero_pool_count < PMM_ZERO_POOL_SIZE;
+}
+
+static void pmm_free_frames(uint32_t addr) {
+    uint32_t pfn = addr >> PAGE_SHIFT;
+    if (pfn >= frame_count) return;
+    if (frame_map[pfn].flags & (FRAME_FREE | FRAME_RESERVED)) return;  // Double free or not a block head
+    if (frame_map[pfn].ref_count > 1) {
+        frame_map[pfn].ref_count--;
+        return;
+    }
+
+    uint32_t order = frame_map[pfn].order;
+    frame_map[pfn].ref_count = 0;
+    free_area[order].nr_used--;
+    free_frames_count += 1u << order;
+    pmm_release_block(pfn, order);
+}
+
+// Drop a reference to a block returned by alloc_frames(), the last one frees
+// it. The order is remembered per block.
+void free_frames(uint32_t addr) {
+    uint32_t flags = irq_save();
+    pmm_free_frames(addr);
+    irq_restore(flags);
+}
+
+uint32_t alloc_frame() {
+    return alloc_frames(0);
+}
+
+void free_frame(uint32_t addr) {
+    free_frames(addr);
+}
+
+// Another mapping shares this block, it now takes one more free_frames() to release
+void ref_frame(uint32_t addr) {
+    uint32_t pfn = addr >> PAGE_SHIFT;
+    if (pfn >= frame_count || (frame_map[pfn].flags & (FRAME_FREE | FRAME_RESERVED))) return;
+    frame_map[pfn].ref_count++;
+}
+
+uint32_t frame_ref_count(uint32_t addr) {
+    uint32_t pfn = addr >> PAGE_SHIFT;
+    if (pfn >= frame_count) return 0;
+    return frame_map[pfn].ref_count;
+}
+
+uint32_t get_free_frames() {
+    return free_frames_count + zero_pool_count;
+}
+
+// One past the highest frame the allocator knows about
+uint32_t get_memory_top() {
+    return frame_count << PAGE_SHIFT;
+}
+
+uint32_t get_total_frames() {
+    return total_frames;
+}
+
+void print_frame_stats() {
+    printf("Physical frames: %d free of %d\n", get_free_frames(), total_frames);
+    printf("  zeroed pool: %d ready, %d hits, %d misses\n",
+           zero_pool_count, zero_pool_hits, zero_pool_misses);
+    for (uint32_t order = 0; order <= PMM_MAX_ORDER; order++) {
+        printf("  order %d (%d KB): %d free, %d used\n",
+               order, (PAGE_SIZE / 1024) << order,
+               free_area[order].nr_free, free_area[order].nr_used);
+    }
+}
+
+#endif
@@ -0,0 +1,441 @@
+#ifndef SCHED_H
+#define SCHED_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "cpu.h"
+#include "list.h"
+#include "klog.h"
+#include "timer.h"
+
+// O(1) priority scheduler.
+// Every priority level has its own FIFO run queue, and bit n of
+// sched_bitmap is set while queue n is non-empty, so the next task is the
+// head of the queue named by the lowest set bit: a single bsf however many
+// tasks are runnable. Priority 0 is the most urgent. The running task is
+// not on any queue. It keeps the CPU until its time slice (longer for more
+// urgent priorities) runs out or something more urgent becomes runnable,
+// then goes to the back of its queue. A task woken from blocking is boosted
+// SCHED_BOOST levels and loses the boost a level per slice it uses up, so
+// interactive tasks stay ahead of batch work without starving it for long.
+//
+// Every switch is a swtch() between kernel stacks. A task preempted by the
+// timer is switched from inside trap_dispatch() and later resumes through
+// the common iret in asm.s; a task that yields or blocks resumes where it
+// called swtch(). New tasks start out looking like a preempted task.
+//
+// There is no periodic tick. Slices are measured with ktime_ns(), and
+// after every scheduling decision sched_update_timer() arms the one-shot
+// timer for the earliest of the running task's slice expiry (only while
+// something else is waiting to run) and the first sleeper's wake time.
+// With one task running or everything idle, nothing is armed at all.
+
+#define SCHED_PRIORITIES        32   // One bit each in sched_bitmap
+#define SCHED_DEFAULT_PRIORITY  16
+#define SCHED_BOOST             4    // Levels gained by a task that wakes from blocking
+#define SCHED_MAX_SLICE         10   // Quanta for priority 0
+#define SCHED_MIN_SLICE         2    // Quanta for the least urgent priority
+#define SCHED_QUANTUM           (10 * NSEC_PER_MSEC)
+
+typedef struct run_queue {
+    list_node_t tasks;               // Head runs next, requeued tasks go to the tail
+    uint32_t count;
+} run_queue_t;
+
+// Tasks blocked on some event, woken in FIFO order
+typedef struct wait_queue {
+    list_node_t waiters;
+} wait_queue_t;
+
+static run_queue_t run_queues[SCHED_PRIORITIES];
+static uint32_t sched_bitmap = 0;           // Bit n set while run_queues[n] is non-empty
+static uint32_t sched_nr_ready = 0;         // Tasks on run queues
+static bool sched_need_resched = false;     // Set by sched_timer()/sched_wakeup()
+static list_node_t sleep_queue;             // Sleeping tasks by wake_time, earliest first
+
+// Cycle cost of each way of switching tasks, see sched_stats()
+typedef struct switch_stats {
+    const char *name;
+    uint32_t count;
+    uint64_t cycles;
+    uint64_t min;
+    uint64_t max;
+} switch_stats_t;
+
+static switch_stats_t sched_yield_stats = { .name = "voluntary", .min = UINT64_MAX };
+static switch_stats_t sched_preempt_stats = { .name = "preemptive", .min = UINT64_MAX };
+static switch_stats_t *switch_pending = NULL;  // Switch in flight, finished by sched_switch_done()
+static uint64_t switch_start;                  // TSC when it started
+
+// Slice length in nanoseconds
+static inline uint32_t sched_slice(uint32_t priority) {
+    return (SCHED_MAX_SLICE - (SCHED_MAX_SLICE - SCHED_MIN_SLICE) * priority / (SCHED_PRIORITIES - 1)) * SCHED_QUANTUM;
+}
+
+// Most urgent non-empty queue, only meaningful while sched_bitmap != 0
+static inline uint32_t sched_first_priority() {
+    uint32_t priority;
+    __asm__("bsfl %1, %0" : "=r"(priority) : "rm"(sched_bitmap));
+    return priority;
+}
+
+void sched_set_priority(process_t *process, uint32_t priority) {
+    if (priority >= SCHED_PRIORITIES) priority = SCHED_PRIORITIES - 1;
+    process->base_priority = priority;
+    process->priority = priority;
+    process->time_slice = sched_slice(priority);
+}
+
+void init_scheduler() {
+    for (uint32_t i = 0; i < SCHED_PRIORITIES; i++) {
+        list_init(&run_queues[i].tasks);
+        run_queues[i].count = 0;
+    }
+    list_init(&sleep_queue);
+    sched_bitmap = 0;
+    sched_nr_ready = 0;
+}
+
+void sched_init_task(process_t *process) {
+    sched_set_priority(process, SCHED_DEFAULT_PRIORITY);
+}
+
+// Make a task runnable, behind everything already queued at its priority.
+// The queues are shared with interrupt handlers that wake tasks, so they
+// are only changed with interrupts off.
+void sched_enqueue(process_t *process) {
+    uint32_t flags = irq_save();
+    run_queue_t *queue = &run_queues[process->priority];
+    process->state = READY;
+    list_add_tail(&queue->tasks, &process->run_node);
+    queue->count++;
+    sched_bitmap |= 1u << process->priority;
+    sched_nr_ready++;
+    irq_restore(flags);
+}
+
+// Take a queued task off its run queue, wherever it is in the queue
+void sched_dequeue(process_t *process) {
+    run_queue_t *queue = &run_queues[process->priority];
+    list_remove(&process->run_node);
+    queue->count--;
+    if (list_empty(&queue->tasks)) sched_bitmap &= ~(1u << process->priority);
+    sched_nr_ready--;
+}
+
+// Take the most urgent runnable task off its queue, NULL if there is none
+process_t *sched_pick_next() {
+    if (sched_bitmap == 0) return NULL;
+
+    list_node_t *node = list_first(&run_queues[sched_first_priority()].tasks);
+    process_t *process = list_entry(node, process_t, run_node);
+    sched_dequeue(process);
+    process->state = RUNNING;
+    process->slice_end = ktime_ns() + process->time_slice;
+    return process;
+}
+
+// Change a task's priority, moving it to the right queue if it is waiting to run
+void sched_change_priority(process_t *process, uint32_t priority) {
+    uint32_t flags = irq_save();
+    bool queued = list_linked(&process->run_node);
+    if (queued) sched_dequeue(process);
+    sched_set_priority(process, priority);
+    if (queued) sched_enqueue(process);
+    irq_restore(flags);
+}
+
+// Choose what runs next and make it current_process. A still running task
+// is requeued with what is left of its slice, so with nothing else runnable
+// it simply continues. A task that blocked stays current only if there is
+// nothing else to run.
+process_t *schedule() {
+    process_t *prev = current_process;
+    sched_need_resched = false;
+
+    if (prev && prev->state == RUNNING) {
+        uint64_t now = ktime_ns();
+        prev->time_slice = prev->slice_end > now ? (uint32_t)(prev->slice_end - now) : sched_slice(prev->priority);
+        sched_enqueue(prev);
+    }
+    process_t *next = sched_pick_next();
+    if (next == NULL) next = prev;
+
+    current_process = next;
+    sched_update_timer();
+    return next;
+}
+
+// Make a blocked task runnable again with a priority boost. Takes effect
+// at the next switch if it is now more urgent than the running task.
+static void sched_wake_task(process_t *process) {
+    if (process->state != WAITING) return;
+
+    // Off whatever wait queue or the sleep queue it was on
+    if (list_linked(&process->wait_node)) list_remove(&process->wait_node);
+
+    process->priority = process->base_priority > SCHED_BOOST ? process->base_priority - SCHED_BOOST : 0;
+    process->time_slice = sched_slice(process->priority);
+    if (process == current_process) {
+        // Blocked, but nothing else was runnable so it never left the CPU
+        process->state = RUNNING;
+        process->slice_end = ktime_ns() + process->time_slice;
+        return;
+    }
+    sched_enqueue(process);
+    if (current_process && process->priority < current_process->priority) sched_need_resched = true;
+}
+
+// Arm the timer for the next thing the scheduler has to act on, or stop it
+void sched_update_timer() {
+    uint64_t deadline = TIMER_NEVER;
+    list_node_t *node = list_first(&sleep_queue);
+    if (node) deadline = list_entry(node, process_t, wait_node)->wake_time;
+
+    // A slice only needs to end if someone else could use the CPU
+    process_t *current = current_process;
+    if (current && current->state == RUNNING && sched_nr_ready && current->slice_end < deadline) {
+        deadline = current->slice_end;
+    }
+    timer_set_deadline(deadline);
+}
+
+// Timer interrupt at clock time `now`: wake due sleepers and end the
+// running task's slice if it is over. Returns true when it should be
+// switched out, otherwise the timer is rearmed for the next deadline.
+bool sched_timer(uint64_t now) {
+    list_node_t *node;
+    while ((node = list_first(&sleep_queue)) != NULL) {
+        process_t *sleeper = list_entry(node, process_t, wait_node);
+        if (sleeper->wake_time > now) break;
+        sched_wake_task(sleeper);
+    }
+
+    process_t *current = current_process;
+    if (current && current->state == RUNNING && now >= current->slice_end) {
+        // A used up slice costs one level of any wakeup boost
+        if (current->priority < current->base_priority) current->priority++;
+        current->time_slice = sched_slice(current->priority);
+        current->slice_end = now + current->time_slice;
+        if (sched_nr_ready) sched_need_resched = true;
+    }
+    if (current && sched_bitmap && sched_first_priority() < current->priority) sched_need_resched = true;
+    if (current && current->state != RUNNING) sched_need_resched = true;
+
+    if (sched_need_resched && preempt_count) {
+        // Left to preempt_enable()
+        preempt_pending = true;
+        sched_update_timer();
+        return false;
+    }
+    if (!sched_need_resched) sched_update_timer();
+    return sched_need_resched;
+}
+
+// Wake a blocked task and rearm the timer for whatever is due next
+void sched_wakeup(process_t *process) {
+    sched_wake_task(process);
+    sched_update_timer();
+}
+
+// Charge the switch in flight to its stats. Runs first thing in every task
+// coming out of swtch(), including new tasks via task_entry.
+void sched_switch_done() {
+    if (switch_pending == NULL) return;
+
+    uint64_t cycles = rdtsc() - switch_start;
+    switch_pending->count++;
+    switch_pending->cycles += cycles;
+    if (cycles < switch_pending->min) switch_pending->min = cycles;
+    if (cycles > switch_pending->max) switch_pending->max = cycles;
+    switch_pending = NULL;
+}
+
+// Move the CPU from prev to next (already current_process). Returns once
+// prev is picked to run again.
+static void context_switch(process_t *prev, process_t *next, switch_stats_t *stats, uint64_t start) {
+    switch_address_space(next->mm);
+    fpu_switch_to(next);
+    switch_start = start;
+    switch_pending = stats;
+    swtch(&prev->stack_pointer, next->stack_pointer);
+    sched_switch_done();
+}
+
+// Give up the CPU to the most urgent runnable task, if there is one
+void sched_yield() {
+    if (current_process == NULL) return;  // kmain, see sched_start()
+
+    uint32_t flags = irq_save();
+    uint64_t start = rdtsc();
+    process_t *prev = current_process;
+    process_t *next = schedule();
+    if (prev && next != prev) context_switch(prev, next, &sched_yield_stats, start);
+    irq_restore(flags);
+}
+
+// Timer preemption, from trap_dispatch() with interrupts off. `start` is
+// the TSC at trap entry so the cost includes the whole interrupt path.
+void sched_preempt(uint64_t start) {
+    process_t *prev = current_process;
+    if (prev == NULL) return;  // Idle in sched_start(), which picks the task up itself
+    process_t *next = schedule();
+    if (prev && next != prev) context_switch(prev, next, &sched_preempt_stats, start);
+}
+
+// Nothing is runnable. Does a batch of deferred work with interrupts on,
+// then halts until an interrupt unless there is more work or something
+// became runnable meanwhile (or `waiter` was woken). Called and returns
+// with interrupts off. sti only takes effect after the next instruction,
+// so no wakeup can slip in between the last check and the hlt.
+static void sched_idle(process_t *waiter) {
+    __asm__ __volatile__("sti" : : : "memory");
+    bool busy = klog_drain(KLOG_DRAIN_BATCH);
+    if (pmm_refill_zero_pool(PMM_ZERO_BATCH)) busy = true;
+    __asm__ __volatile__("cli" : : : "memory");
+
+    if (busy || sched_nr_ready || (waiter && waiter->state != WAITING)) return;
+    __asm__ __volatile__("sti; hlt; cli" : : : "memory");
+}
+
+// Run the queued tasks from kmain, returning once every one has terminated.
+// kmain doubles as the idle task: while tasks exist but all of them are
+// waiting, the CPU comes back here and halts until one is woken.
+void sched_start() {
+    uint32_t flags = irq_save();
+    for (;;) {
+        reap_exited_process();
+        process_t *next = sched_pick_next();
+        if (next) {
+            current_process = next;
+            sched_update_timer();
+            switch_address_space(next->mm);
+            fpu_switch_to(next);
+            swtch(&scheduler_stack_pointer, next->stack_pointer);
+
+            // terminate_process() switched back here with nothing left to run
+            switch_pending = NULL;
+            continue;
+        }
+        if (nr_tasks == 0) break;
+        sched_idle(NULL);
+    }
+    irq_restore(flags);
+}
+
+// Wait for a task marked WAITING to be woken. If nothing else is runnable
+// it stays on the CPU and halts until an interrupt wakes it. The state is
+// checked with interrupts off right up to the hlt: a wakeup landing after
+// the check would otherwise leave it halted with no timer armed.
+static void sched_wait(process_t *current) {
+    uint32_t flags = irq_save();
+    while (current->state == WAITING) {
+        sched_yield();
+        if (current->state == WAITING) sched_idle(current);
+    }
+    irq_restore(flags);
+}
+
+// Block the running task until sched_wakeup()
+void sched_block() {
+    process_t *current = current_process;
+    if (current == NULL) return;
+
+    uint32_t flags = irq_save();
+    current->state = WAITING;
+    sched_need_resched = true;
+    irq_restore(flags);
+    sched_wait(current);
+}
+
+// Block the running task until ktime_ns() reaches `deadline`
+void sleep_until(uint64_t deadline) {
+    process_t *current = current_process;
+    if (current == NULL) return;
+
+    uint32_t flags = irq_save();
+    current->wake_time = deadline;
+    list_node_t *pos = &sleep_queue;
+    list_for_each(node, &sleep_queue) {
+        if (list_entry(node, process_t, wait_node)->wake_time > deadline) {
+            pos = node;
+            break;
+        }
+    }
+    // Before the first later sleeper, so equal deadlines wake in FIFO order
+    list_insert_between(&current->wait_node, pos->prev, pos);
+    current->state = WAITING;
+    sched_need_resched = true;
+    sched_update_timer();
+    irq_restore(flags);
+    sched_wait(current);
+}
+
+void sleep_ms(uint32_t ms) {
+    sleep_until(ktime_ns() + (uint64_t)ms * NSEC_PER_MSEC);
+}
+
+void wait_queue_init(wait_queue_t *queue) {
+    list_init(&queue->waiters);
+}
+
+// Block the running task on `queue` until wake_up_one()/wake_up_all()
+void sleep_on(wait_queue_t *queue) {
+    process_t *current = current_process;
+    if (current == NULL) return;
+
+    // Queued and marked in one step so a wakeup cannot slip in between
+    uint32_t flags = irq_save();
+    list_add_tail(&queue->waiters, &current->wait_node);
+    current->state = WAITING;
+    sched_need_resched = true;
+    irq_restore(flags);
+    sched_wait(current);
+}
+
+// Wake the longest waiting task, returns false if nobody was waiting
+bool wake_up_one(wait_queue_t *queue) {
+    uint32_t flags = irq_save();
+    list_node_t *node = list_first(&queue->waiters);
+    if (node) {
+        list_remove(node);
+        sched_wakeup(list_entry(node, process_t, wait_node));
+    }
+    irq_restore(flags);
+    return node != NULL;
+}
+
+void wake_up_all(wait_queue_t *queue) {
+    while (wake_up_one(queue));
+}
+
+static void sched_print_switch_stats(switch_stats_t *stats) {
+    uint32_t remainder;
+    uint64_t average = stats->count ? div_u64_u32(stats->cycles, stats->count, &remainder) : 0;
+    printf("  %s: %d switches, %llu cycles average (min %llu, max %llu)\n", stats->name,
+           stats->count, average, stats->count ? stats->min : 0, stats->max);
+}
+
+void sched_stats() {
+    printf("Context switch cost:\n");
+    sched_print_switch_stats(&sched_yield_stats);
+    sched_print_switch_stats(&sched_preempt_stats);
+    printf("Timer: %s, %d interrupts, %d reprograms\n", timer_device_names[timer_device],
+           timer_interrupts, timer_reprograms);
+}
+
+// Helper function to print the state of the queue (add this for debugging)
+void print_queue_state() {
+    printf("Current process: %x (pid %d)\n", (unsigned int)current_process,
+           current_process ? current_process->pid : 0);
+    printf("Run queues (%d ready of %d tasks):\n", sched_nr_ready, nr_tasks);
+    for (uint32_t priority = 0; priority < SCHED_PRIORITIES; priority++) {
+        list_for_each(node, &run_queues[priority].tasks) {
+            process_t *temp = list_entry(node, process_t, run_node);
+            printf("  [%d] Process %d at %x (func: %x)\n",
+                   priority, temp->pid, (unsigned int)temp, (unsigned int)temp->func);
+        }
+    }
+}
+
+#endif
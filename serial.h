@@ -0,0 +1,131 @@
+#ifndef SERIAL_H
+#define SERIAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "vga.h"
+#include "cpu.h"
+
+// Interrupt driven COM1 driver for a 16550 UART.
+// Output is queued in a ring and drained 16 bytes at a time by the IRQ4
+// handler whenever the transmit FIFO empties, so writers only spin when the
+// ring itself is full. Received bytes are queued for serial_read().
+
+#define COM1_PORT          0x3F8
+#define COM1_IRQ           4
+#define COM1_VECTOR        (0x20 + COM1_IRQ)
+
+#define UART_DATA          0  // RBR on read, THR on write (DLL with DLAB)
+#define UART_IER           1  // Interrupt enable (DLM with DLAB)
+#define UART_IIR           2  // Interrupt identification on read
+#define UART_FCR           2  // FIFO control on write
+#define UART_LCR           3  // Line control
+#define UART_MCR           4  // Modem control
+#define UART_LSR           5  // Line status
+
+#define UART_IER_RX        0x01  // Received data available
+#define UART_IER_TX        0x02  // Transmit holding register empty
+#define UART_LCR_8N1       0x03
+#define UART_LCR_DLAB      0x80  // Divisor latch access
+#define UART_FCR_ENABLE    0xC7  // Enable and clear both FIFOs, RX trigger at 14 bytes
+#define UART_IIR_FIFO      0xC0  // Both bits set when a working 16550A FIFO is enabled
+#define UART_MCR_LOOPBACK  0x1E
+#define UART_MCR_NORMAL    0x0B  // DTR, RTS and OUT2 (OUT2 gates the IRQ line)
+#define UART_LSR_DATA      0x01  // A received byte is waiting
+#define UART_LSR_THRE      0x20  // Transmit holding register (and FIFO) empty
+
+#define UART_FIFO_SIZE     16
+#define SERIAL_BAUD_DIVISOR 1    // 115200 baud
+
+#define SERIAL_TX_SIZE     4096  // Power of two
+#define SERIAL_RX_SIZE     256   // Power of two
+
+static char serial_tx[SERIAL_TX_SIZE];
+static char serial_rx[SERIAL_RX_SIZE];
+static volatile uint32_t serial_tx_head = 0;  // Written by serial_write()
+static volatile uint32_t serial_tx_tail = 0;  // Advanced as bytes go into the FIFO
+static volatile uint32_t serial_rx_head = 0;  // Written by the IRQ handler
+static volatile uint32_t serial_rx_tail = 0;  // Advanced by serial_read()
+static bool serial_present = false;
+static bool serial_has_fifo = false;
+static uint32_t serial_rx_dropped = 0;
+
+// Move queued bytes into the transmit FIFO if it is empty. Called with
+// interrupts off; arms the THRE interrupt while data is left in the ring.
+static void serial_fill_fifo() {
+    if (inb(COM1_PORT + UART_LSR) & UART_LSR_THRE) {
+        uint32_t burst = serial_has_fifo ? UART_FIFO_SIZE : 1;
+        while (burst-- && serial_tx_tail != serial_tx_head) {
+            outb(COM1_PORT + UART_DATA, serial_tx[serial_tx_tail & (SERIAL_TX_SIZE - 1)]);
+            serial_tx_tail++;
+        }
+    }
+    outb(COM1_PORT + UART_IER,
+         serial_tx_tail != serial_tx_head ? (UART_IER_RX | UART_IER_TX) : UART_IER_RX);
+}
+
+void init_serial() {
+    outb(COM1_PORT + UART_IER, 0);                 // No interrupts while configuring
+    outb(COM1_PORT + UART_LCR, UART_LCR_DLAB);
+    outb(COM1_PORT + UART_DATA, SERIAL_BAUD_DIVISOR & 0xFF);
+    outb(COM1_PORT + UART_IER, SERIAL_BAUD_DIVISOR >> 8);
+    outb(COM1_PORT + UART_LCR, UART_LCR_8N1);
+    outb(COM1_PORT + UART_FCR, UART_FCR_ENABLE);
+
+    // A byte sent in loopback mode must come straight back, or there is no UART
+    outb(COM1_PORT + UART_MCR, UART_MCR_LOOPBACK);
+    outb(COM1_PORT + UART_DATA, 0xAE);
+    if (inb(COM1_PORT + UART_DATA) != 0xAE) return;
+
+    serial_has_fifo = (inb(COM1_PORT + UART_IIR) & UART_IIR_FIFO) == UART_IIR_FIFO;
+    outb(COM1_PORT + UART_MCR, UART_MCR_NORMAL);
+    outb(COM1_PORT + UART_IER, UART_IER_RX);
+    serial_present = true;
+}
+
+// Queue len bytes, newlines go out as CR LF. Only spins if the ring is full.
+void serial_write(const char *s, size_t len) {
+    if (!serial_present) return;
+
+    uint32_t flags = irq_save();
+    for (size_t i = 0; i < len; i++) {
+        bool crlf = (s[i] == '\n');
+        while (serial_tx_head - serial_tx_tail > SERIAL_TX_SIZE - 2) {
+            // Ring full: push bytes out by polling until there is room
+            while (!(inb(COM1_PORT + UART_LSR) & UART_LSR_THRE));
+            serial_fill_fifo();
+        }
+        if (crlf) serial_tx[serial_tx_head++ & (SERIAL_TX_SIZE - 1)] = '\r';
+        serial_tx[serial_tx_head++ & (SERIAL_TX_SIZE - 1)] = s[i];
+    }
+    serial_fill_fifo();
+    irq_restore(flags);
+}
+
+// Next received byte, or -1 if none is waiting
+int serial_read() {
+    if (serial_rx_tail == serial_rx_head) return -1;
+    char c = serial_rx[serial_rx_tail & (SERIAL_RX_SIZE - 1)];
+    serial_rx_tail++;
+    return (uint8_t)c;
+}
+
+#pragma GCC target("general-regs-only")
+__attribute__((interrupt)) void serial_handler(struct interrupt_frame* frame) {
+    while (inb(COM1_PORT + UART_LSR) & UART_LSR_DATA) {
+        char c = inb(COM1_PORT + UART_DATA);
+        if (serial_rx_head - serial_rx_tail < SERIAL_RX_SIZE) {
+            serial_rx[serial_rx_head & (SERIAL_RX_SIZE - 1)] = c;
+            serial_rx_head++;
+        } else {
+            serial_rx_dropped++;
+        }
+    }
+    serial_fill_fifo();
+
+    outb(0x20, 0x20);  // EOI to Master PIC
+}
+#pragma GCC reset_options
+
+#endif
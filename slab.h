@@ -0,0 +1,228 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "pmm.h"
+#include "vga.h"
+#include "x86.h"
+#include "list.h"
+
+// Object caches for fixed-size kernel structures.
+// Each slab is a naturally aligned block from the frame allocator with a
+// small slab_t at its start followed by equal-sized object slots, so the
+// owning slab of any object is found by masking its address. Free slots
+// are linked through the objects themselves and reused LIFO while warm.
+
+#define SLAB_MIN_OBJECTS   8   // Grow the slab order until this many objects fit
+#define SLAB_KEEP_EMPTY    1   // Empty slabs a cache holds on to before freeing
+#define SLAB_MIN_ALIGN     sizeof(void *)
+
+#define SLAB_ALIGN_UP(value, align) (((value) + (align) - 1) & ~((align) - 1))
+
+typedef struct slab {
+    list_node_t node;          // On its cache's partial, full or empty list
+    struct kmem_cache *cache;  // Owning cache
+    void *free_list;           // First free object in this slab
+    uint32_t in_use;           // Objects handed out from this slab
+} slab_t;
+
+typedef struct kmem_cache {
+    const char *name;          // Shown in kmem_cache_stats()
+    size_t object_size;        // Size requested by the user
+    size_t slot_size;          // object_size rounded up to the alignment
+    size_t first_offset;       // Offset of the first object inside a slab
+    uint32_t slab_order;       // Each slab is 2^slab_order frames
+    uint32_t objects_per_slab;
+    void (*ctor)(void *);      // Optional, runs on every object handed out
+    list_node_t partial;       // Slabs with both used and free objects
+    list_node_t full;          // Slabs with no free objects
+    list_node_t empty;         // Slabs with no used objects
+    uint32_t slab_count;       // Slabs owned, in any list
+    uint32_t empty_count;      // Slabs on the empty list
+    uint32_t objects_in_use;   // Objects currently handed out
+    struct kmem_cache *next;   // Next cache in kmem_caches
+} kmem_cache_t;
+
+void *kmem_cache_alloc(kmem_cache_t *cache);
+
+// Caches are themselves slab objects, bootstrapped from this static cache
+static kmem_cache_t kmem_cache_cache = {
+    .name = "kmem_cache",
+    .object_size = sizeof(kmem_cache_t),
+    .slot_size = SLAB_ALIGN_UP(sizeof(kmem_cache_t), SLAB_MIN_ALIGN),
+    .first_offset = SLAB_ALIGN_UP(sizeof(slab_t), SLAB_MIN_ALIGN),
+    .slab_order = 0,
+    .objects_per_slab = (PAGE_SIZE - SLAB_ALIGN_UP(sizeof(slab_t), SLAB_MIN_ALIGN))
+                        / SLAB_ALIGN_UP(sizeof(kmem_cache_t), SLAB_MIN_ALIGN),
+    .partial = { &kmem_cache_cache.partial, &kmem_cache_cache.partial },
+    .full = { &kmem_cache_cache.full, &kmem_cache_cache.full },
+    .empty = { &kmem_cache_cache.empty, &kmem_cache_cache.empty },
+};
+static kmem_cache_t *kmem_caches = &kmem_cache_cache;
+
+static slab_t *slab_create(kmem_cache_t *cache) {
+    uint32_t phys_addr = alloc_frames(cache->slab_order);
+    if (phys_addr == 0) return NULL;
+
+    slab_t *slab = (slab_t *)phys_addr;
+    slab->cache = cache;
+    slab->in_use = 0;
+    slab->free_list = NULL;
+
+    // Thread the free list back to front so objects are handed out in address order
+    uintptr_t first = phys_addr + cache->first_offset;
+    for (uint32_t i = cache->objects_per_slab; i-- > 0;) {
+        void **object = (void **)(first + i * cache->slot_size);
+        *object = slab->free_list;
+        slab->free_list = object;
+    }
+
+    cache->slab_count++;
+    return slab;
+}
+
+static void slab_destroy(kmem_cache_t *cache, slab_t *slab) {
+    cache->slab_count--;
+    free_frames((uint32_t)slab);
+}
+
+kmem_cache_t *kmem_cache_create(const char *name, size_t size, size_t align, void (*ctor)(void *)) {
+    if (align < SLAB_MIN_ALIGN) align = SLAB_MIN_ALIGN;
+    if (size < sizeof(void *)) size = sizeof(void *);
+
+    size_t slot_size = SLAB_ALIGN_UP(size, align);
+    size_t first_offset = SLAB_ALIGN_UP(sizeof(slab_t), align);
+
+    uint32_t order = 0;
+    while (order < PMM_MAX_ORDER &&
+           (((size_t)PAGE_SIZE << order) - first_offset) / slot_size < SLAB_MIN_OBJECTS) {
+        order++;
+    }
+    if (((size_t)PAGE_SIZE << order) < first_offset + slot_size) return NULL;
+
+    kmem_cache_t *cache = (kmem_cache_t *)kmem_cache_alloc(&kmem_cache_cache);
+    if (cache == NULL) return NULL;
+
+    *cache = (kmem_cache_t){
+        .name = name,
+        .object_size = size,
+        .slot_size = slot_size,
+        .first_offset = first_offset,
+        .slab_order = order,
+        .objects_per_slab = (((size_t)PAGE_SIZE << order) - first_offset) / slot_size,
+        .ctor = ctor,
+    };
+    list_init(&cache->partial);
+    list_init(&cache->full);
+    list_init(&cache->empty);
+
+    uint32_t flags = irq_save();
+    cache->next = kmem_caches;
+    kmem_caches = cache;
+    irq_restore(flags);
+    return cache;
+}
+
+static void *slab_alloc_object(kmem_cache_t *cache) {
+    slab_t *slab;
+    list_node_t *node = list_first(&cache->partial);
+    if (node) {
+        slab = list_entry(node, slab_t, node);
+    } else {
+        node = list_first(&cache->empty);
+        if (node) {
+            slab = list_entry(node, slab_t, node);
+            list_remove(&slab->node);
+            cache->empty_count--;
+        } else {
+            slab = slab_create(cache);
+            if (slab == NULL) return NULL;
+        }
+        list_add_head(&cache->partial, &slab->node);
+    }
+
+    void **object = (void **)slab->free_list;
+    slab->free_list = *object;
+    slab->in_use++;
+    cache->objects_in_use++;
+
+    if (slab->free_list == NULL) {
+        list_remove(&slab->node);
+        list_add_head(&cache->full, &slab->node);
+    }
+    return object;
+}
+
+// Slab lists are only touched with interrupts off, so a task preempted
+// mid-update never leaves them half linked for the next one
+void *kmem_cache_alloc(kmem_cache_t *cache) {
+    uint32_t flags = irq_save();
+    void *object = slab_alloc_object(cache);
+    irq_restore(flags);
+
+    if (object && cache->ctor) cache->ctor(object);
+    return object;
+}
+
+static void slab_free_object(kmem_cache_t *cache, void *object) {
+    // Slabs are aligned to their own size, so masking finds the owner
+    slab_t *slab = (slab_t *)((uintptr_t)object & ~((PAGE_SIZE << cache->slab_order) - 1));
+    if (slab->cache != cache) return;
+
+    bool was_full = (slab->free_list == NULL);
+    *(void **)object = slab->free_list;
+    slab->free_list = object;
+    slab->in_use--;
+    cache->objects_in_use--;
+
+    if (was_full) {
+        list_remove(&slab->node);
+        list_add_head(&cache->partial, &slab->node);
+    }
+
+    if (slab->in_use == 0) {
+        list_remove(&slab->node);
+        if (cache->empty_count < SLAB_KEEP_EMPTY) {
+            list_add_head(&cache->empty, &slab->node);
+            cache->empty_count++;
+        } else {
+            slab_destroy(cache, slab);
+        }
+    }
+}
+
+void kmem_cache_free(kmem_cache_t *cache, void *object) {
+    if (object == NULL) return;
+
+    uint32_t flags = irq_save();
+    slab_free_object(cache, object);
+    irq_restore(flags);
+}
+
+// Give every empty slab of a cache back to the frame allocator
+void kmem_cache_shrink(kmem_cache_t *cache) {
+    uint32_t flags = irq_save();
+    list_node_t *node;
+    while ((node = list_first(&cache->empty)) != NULL) {
+        list_remove(node);
+        slab_destroy(cache, list_entry(node, slab_t, node));
+    }
+    cache->empty_count = 0;
+    irq_restore(flags);
+}
+
+void kmem_cache_stats() {
+    printf("Slab caches:\n");
+    for (kmem_cache_t *cache = kmem_caches; cache; cache = cache->next) {
+        uint32_t capacity = cache->slab_count * cache->objects_per_slab;
+        uint32_t slab_bytes = cache->slab_count * (PAGE_SIZE << cache->slab_order);
+        uint32_t efficiency = slab_bytes ? (cache->objects_in_use * cache->object_size * 100) / slab_bytes : 0;
+        printf("  %s: %d/%d objects, %d slabs (%d empty), %d%% used\n",
+               cache->name, cache->objects_in_use, capacity,
+               cache->slab_count, cache->empty_count, efficiency);
+    }
+}
+
+#endif
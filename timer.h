@@ -0,0 +1,189 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "vga.h"
+#include "klib.h"
+#include "cpu.h"
+#include "klog.h"
+#include "apic.h"
+
+// Kernel clock and the one-shot timer behind every scheduler deadline.
+// The clock is the TSC, calibrated against PIT channel 2 at boot and
+// scaled by ktime_ns() to nanoseconds since then. Deadlines are ktime_ns()
+// values. They are delivered by the local APIC timer, in TSC-deadline mode
+// when the CPU has it (one MSR write, no conversion to a countdown), else
+// counting down, and by PIT channel 0 in mode 0 only when there is no
+// local APIC. Whichever it is, it is armed for the next deadline only, so
+// when nothing is due there are no timer interrupts at all.
+//
+// Deadlines further away than one countdown (about 55 ms on the PIT) are
+// reached in several steps: the interrupt fires early, the owner sees its
+// deadline has not passed yet and the timer is simply rearmed.
+
+#define NSEC_PER_MSEC      1000000u
+#define NSEC_PER_SEC       1000000000u
+
+#define PIT_FREQUENCY      1193182   // Input clock, Hz
+#define PIT_CHANNEL0       0x40
+#define PIT_CHANNEL2       0x42
+#define PIT_COMMAND        0x43
+#define PIT_ONESHOT        0x30      // 00 11 000 0: Channel 0, lobyte/hibyte, interrupt on terminal count
+#define PIT_CH2_ONESHOT    0xB0      // 10 11 000 0: Channel 2, lobyte/hibyte, interrupt on terminal count
+#define PIT_GATE           0x61      // System control port B
+#define PIT_GATE_CH2       0x01      // Channel 2 counts while set
+#define PIT_SPEAKER        0x02      // Channel 2 output drives the speaker
+#define PIT_OUT2           0x20      // Channel 2 output pin
+#define PIT_MAX_COUNT      0xFFFF
+#define PIT_MIN_COUNT      16        // About 13 us, so we are out of the way before it fires
+
+#define TIMER_CALIBRATE_MS 10
+#define TIMER_CALIBRATE_SPINS 1000000   // Give up on a PIT that never counts down
+#define CLOCK_SHIFT        24           // Fixed point of the *_mult conversion factors
+
+#define TIMER_NEVER        UINT64_MAX
+
+typedef enum {
+    TIMER_PIT,
+    TIMER_LAPIC,
+    TIMER_TSC_DEADLINE,
+} timer_device_t;
+
+static const char *timer_device_names[] = { "PIT", "LAPIC", "TSC-deadline" };
+
+static timer_device_t timer_device = TIMER_PIT;
+static uint64_t tsc_boot = 0;                   // TSC when ktime_ns() read 0
+static uint32_t tsc_khz = 0;
+static uint32_t lapic_timer_khz = 0;            // After LAPIC_DIVIDE_16
+static uint32_t tsc_to_ns_mult = 0;             // Cycles to ns, scaled by 2^CLOCK_SHIFT
+static uint32_t ns_to_tsc_mult = 0;             // And back
+static uint32_t ns_to_lapic_mult = 0;
+static uint32_t ns_to_pit_mult = 0;
+static uint64_t timer_deadline = TIMER_NEVER;   // Deadline the timer is armed for
+static uint32_t timer_interrupts = 0;
+static uint32_t timer_reprograms = 0;
+
+// value * mult >> shift, without losing the top of a 64-bit value
+static inline uint64_t mul_u64_u32_shr(uint64_t value, uint32_t mult, uint32_t shift) {
+    uint64_t low = (uint64_t)(uint32_t)value * mult;
+    uint64_t high = (uint64_t)(uint32_t)(value >> 32) * mult;
+    return (high << (32 - shift)) + (low >> shift);
+}
+
+// Factor for mul_u64_u32_shr(x, mult, CLOCK_SHIFT) == x * num / den
+static uint32_t clock_mult(uint32_t num, uint32_t den) {
+    uint32_t remainder;
+    return (uint32_t)div_u64_u32((uint64_t)num << CLOCK_SHIFT, den, &remainder);
+}
+
+// Monotonic nanoseconds since the clock was calibrated, 0 until then
+uint64_t ktime_ns() {
+    return mul_u64_u32_shr(rdtsc() - tsc_boot, tsc_to_ns_mult, CLOCK_SHIFT);
+}
+
+// Count TSC cycles and LAPIC timer ticks across TIMER_CALIBRATE_MS of PIT
+// channel 2, which can be polled without an interrupt
+static void timer_calibrate() {
+    uint32_t count = PIT_FREQUENCY / 1000 * TIMER_CALIBRATE_MS;
+    uint32_t flags = irq_save();
+    uint8_t gate = inb(PIT_GATE);
+
+    outb(PIT_GATE, (gate & ~PIT_SPEAKER) | PIT_GATE_CH2);
+    outb(PIT_COMMAND, PIT_CH2_ONESHOT);
+    outb(PIT_CHANNEL2, count & 0xFF);
+    outb(PIT_CHANNEL2, (count >> 8) & 0xFF);
+    if (lapic) lapic_write(LAPIC_TIMER_INITIAL, UINT32_MAX);
+    uint64_t start = rdtsc();
+
+    uint32_t spins = 0;
+    while (!(inb(PIT_GATE) & PIT_OUT2) && ++spins < TIMER_CALIBRATE_SPINS);
+    uint64_t cycles = rdtsc() - start;
+    uint32_t ticks = lapic ? UINT32_MAX - lapic_read(LAPIC_TIMER_CURRENT) : 0;
+
+    if (lapic) lapic_write(LAPIC_TIMER_INITIAL, 0);
+    outb(PIT_GATE, gate);
+    irq_restore(flags);
+
+    if (spins == TIMER_CALIBRATE_SPINS) klog(KLOG_WARN, "timer: PIT channel 2 did not count, calibration is off");
+
+    // The PIT counted for count / PIT_FREQUENCY seconds
+    uint32_t remainder;
+    tsc_boot = start;
+    tsc_khz = (uint32_t)div_u64_u32(cycles * PIT_FREQUENCY, count * 1000, &remainder);
+    lapic_timer_khz = (uint32_t)div_u64_u32((uint64_t)ticks * PIT_FREQUENCY, count * 1000, &remainder);
+}
+
+// Countdown from now to `deadline` in ticks of a `mult` clock, at least 1
+static uint32_t timer_countdown(uint64_t deadline, uint32_t mult, uint32_t max) {
+    uint64_t now = ktime_ns();
+    uint64_t ticks = deadline > now ? mul_u64_u32_shr(deadline - now, mult, CLOCK_SHIFT) + 1 : 1;
+    return ticks > max ? max : (uint32_t)ticks;
+}
+
+// Arm the timer for `deadline`, or stop it for TIMER_NEVER
+void timer_program(uint64_t deadline) {
+    uint32_t flags = irq_save();
+    timer_deadline = deadline;
+    timer_reprograms++;
+
+    switch (timer_device) {
+    case TIMER_TSC_DEADLINE:
+        // Absolute, a deadline already passed fires at once and 0 disarms
+        wrmsr(MSR_TSC_DEADLINE, deadline == TIMER_NEVER ? 0 :
+              tsc_boot + mul_u64_u32_shr(deadline, ns_to_tsc_mult, CLOCK_SHIFT) + 1);
+        break;
+    case TIMER_LAPIC:
+        // An initial count of 0 stops the countdown
+        lapic_write(LAPIC_TIMER_INITIAL, deadline == TIMER_NEVER ? 0 :
+                    timer_countdown(deadline, ns_to_lapic_mult, UINT32_MAX));
+        break;
+    case TIMER_PIT:
+        // A new control word drops the output and stops the count until one is written
+        outb(PIT_COMMAND, PIT_ONESHOT);
+        if (deadline != TIMER_NEVER) {
+            uint32_t count = timer_countdown(deadline, ns_to_pit_mult, PIT_MAX_COUNT);
+            if (count < PIT_MIN_COUNT) count = PIT_MIN_COUNT;
+            outb(PIT_CHANNEL0, count & 0xFF);
+            outb(PIT_CHANNEL0, (count >> 8) & 0xFF);
+        }
+        break;
+    }
+    irq_restore(flags);
+}
+
+// Aim the timer at `deadline`, skipping the device access if it already is
+static inline void timer_set_deadline(uint64_t deadline) {
+    if (deadline != timer_deadline) timer_program(deadline);
+}
+
+// Timer interrupt: the timer is now stopped until it is rearmed. Returns
+// the current time.
+uint64_t timer_expired() {
+    timer_deadline = TIMER_NEVER;
+    timer_interrupts++;
+    return ktime_ns();
+}
+
+// Calibrate the clock and pick the best timer for deadlines. Runs after
+// the IDT and paging are set up, with the PIT's channel 0 stopped.
+void init_timer() {
+    bool have_lapic = init_lapic();
+    timer_calibrate();
+
+    tsc_to_ns_mult = clock_mult(NSEC_PER_MSEC, tsc_khz);
+    ns_to_tsc_mult = clock_mult(tsc_khz, NSEC_PER_MSEC);
+    ns_to_pit_mult = clock_mult(PIT_FREQUENCY, NSEC_PER_SEC);
+
+    if (have_lapic && lapic_timer_khz) {
+        ns_to_lapic_mult = clock_mult(lapic_timer_khz, NSEC_PER_MSEC);
+        timer_device = lapic_tsc_deadline ? TIMER_TSC_DEADLINE : TIMER_LAPIC;
+        lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_VECTOR |
+                    (timer_device == TIMER_TSC_DEADLINE ? LAPIC_TIMER_TSC_DEADLINE : LAPIC_TIMER_ONESHOT));
+        // The mode switch has to land before the first deadline MSR write
+        __asm__ __volatile__("mfence" : : : "memory");
+    }
+    timer_program(TIMER_NEVER);
+}
+
+#endif
@@ -4,10 +4,13 @@
 #include <stddef.h>
 #include <stdarg.h>
 #include "klib.h"
+#include "x86.h"
 
 #define TEXT_SCREEN_WIDTH 80
 #define TEXT_SCREEN_HEIGHT 25
 #define TEXT_VIDEO_MEMORY_ADDRESS 0xB8000
+#define TEXT_VIDEO_MEMORY_ROWS 204   // 32 KB of text memory holds this many 80 column rows
+#define CONSOLE_HISTORY_ROWS 200     // Shadow rows kept for scrollback, the screen is the last 25
 
 enum vga_color {
 	VGA_COLOR_BLACK = 0,
@@ -28,23 +31,61 @@ enum vga_color {
 	VGA_COLOR_WHITE = 15,
 };
 
-static int pos = 0;
+static int pos = 0;  // Cursor offset within the visible screen
+
+// The console is drawn into a RAM shadow (a ring of CONSOLE_HISTORY_ROWS rows,
+// indexed by absolute line number) and copied to video memory once per write.
+// Only rows written since the last flush are copied. Scrolling moves the CRTC
+// start address down through the 32 KB of text memory instead of moving the
+// screen contents, and only wraps back to the top (one full redraw) when it
+// runs out of rows.
+static uint16_t console_shadow[CONSOLE_HISTORY_ROWS * TEXT_SCREEN_WIDTH];
+static uint32_t console_top = 0;            // Absolute line shown in screen row 0
+static uint32_t console_dirty_first = 0;    // Absolute lines waiting for a flush
+static uint32_t console_dirty_last = TEXT_SCREEN_HEIGHT - 1;
+static bool console_dirty = true;
+static uint32_t vram_top = 0;               // Absolute line video memory was last scrolled to
+static uint32_t vram_start_row = 0;         // Text memory row the CRTC starts at
+static uint32_t console_view_offset = 0;    // Lines scrolled back, 0 shows live output
+
+// Where console output goes, see console_set_output()
+#define CONSOLE_VGA    (1 << 0)
+#define CONSOLE_SERIAL (1 << 1)
+#define CONSOLE_FRAMEBUFFER (1 << 2)
+static uint32_t console_outputs = CONSOLE_VGA;
+
+extern void serial_write(const char *s, size_t len);
+extern void fb_write(const char *s, size_t len);
+extern void fb_flush();
 
 static inline void outb(uint16_t port, uint8_t value)
 {
     __asm__ volatile ("outb %0, %1" : : "a"(value), "Nd"(port));
 }
 
+// Word at a time once aligned: (v - 0x01010101) & ~v & 0x80808080 is non-zero
+// exactly when one of the four bytes of v is zero. Aligned loads never cross
+// into the next page, so reading past the terminator is safe.
 size_t strlen(const char* str)
 {
-    size_t len = 0;
-    while (str[len])
-        len++;
-    return len;
+    const char *p = str;
+    while ((uintptr_t)p & 3) {
+        if (*p == '\0') return p - str;
+        p++;
+    }
+
+    const uint32_t *word = (const uint32_t *)p;
+    while (!((*word - 0x01010101u) & ~*word & 0x80808080u)) word++;
+
+    p = (const char *)word;
+    while (*p) p++;
+    return p - str;
 }
 
+// Position is relative to the visible screen, the CRTC wants it in text memory
 void update_cursor(int position)
 {
+    position += vram_start_row * TEXT_SCREEN_WIDTH;
     outb(0x3D4, 0x0F); // Set low byte of cursor position
     outb(0x3D5, (uint8_t)(position & 0xFF));
     outb(0x3D4, 0x0E); // Set high byte of cursor position
@@ -61,128 +102,202 @@ uint8_t inb(uint16_t port) {
     return result;
 }
 
-void scroll()
+static inline uint16_t vga_entry(char c)
 {
-    for (int row = 0; row < TEXT_SCREEN_HEIGHT - 1; row++) {
-        for (int col = 0; col < TEXT_SCREEN_WIDTH; col++) {
-            int from = row * TEXT_SCREEN_WIDTH + col;
-            int to = (row + 1) * TEXT_SCREEN_WIDTH + col;
-            *(uint16_t*)(uintptr_t)(TEXT_VIDEO_MEMORY_ADDRESS + from * 2) =
-                *(uint16_t*)(uintptr_t)(TEXT_VIDEO_MEMORY_ADDRESS + to * 2);
+    return (uint16_t)((uint8_t)c | ((uint16_t)(VGA_COLOR_WHITE | VGA_COLOR_BLUE << 4)) << 8);
+}
+
+static inline uint16_t *console_row(uint32_t line)
+{
+    return &console_shadow[(line % CONSOLE_HISTORY_ROWS) * TEXT_SCREEN_WIDTH];
+}
+
+static void console_mark_dirty(uint32_t first, uint32_t last)
+{
+    if (!console_dirty) {
+        console_dirty_first = first;
+        console_dirty_last = last;
+        console_dirty = true;
+        return;
+    }
+    if (first < console_dirty_first) console_dirty_first = first;
+    if (last > console_dirty_last) console_dirty_last = last;
+}
+
+static void set_display_start(uint32_t row)
+{
+    uint32_t offset = row * TEXT_SCREEN_WIDTH;
+    outb(0x3D4, 0x0C); // Start address high byte
+    outb(0x3D5, (uint8_t)((offset >> 8) & 0xFF));
+    outb(0x3D4, 0x0D); // Start address low byte
+    outb(0x3D5, (uint8_t)(offset & 0xFF));
+}
+
+// Copy the dirty rows to video memory and move the cursor, once per write
+static void console_flush()
+{
+    uint16_t *video = (uint16_t *)TEXT_VIDEO_MEMORY_ADDRESS;
+    uint32_t shown = console_top - console_view_offset;
+
+    if (shown != vram_top) {
+        uint32_t advance = shown > vram_top ? shown - vram_top : TEXT_SCREEN_HEIGHT;
+        if (advance < TEXT_SCREEN_HEIGHT &&
+            vram_start_row + advance + TEXT_SCREEN_HEIGHT <= TEXT_VIDEO_MEMORY_ROWS) {
+            // Hardware scroll, the rows that came into view are dirty already
+            vram_start_row += advance;
+            console_mark_dirty(vram_top + TEXT_SCREEN_HEIGHT, shown + TEXT_SCREEN_HEIGHT - 1);
+        } else {
+            vram_start_row = 0;
+            console_mark_dirty(shown, shown + TEXT_SCREEN_HEIGHT - 1);
         }
+        set_display_start(vram_start_row);
+        vram_top = shown;
     }
 
-    // Clear the last row
+    if (console_dirty) {
+        uint32_t first = console_dirty_first > shown ? console_dirty_first : shown;
+        uint32_t last = console_dirty_last < shown + TEXT_SCREEN_HEIGHT - 1
+                      ? console_dirty_last : shown + TEXT_SCREEN_HEIGHT - 1;
+        for (uint32_t line = first; line <= last && first <= last; line++) {
+            memcpy(&video[(vram_start_row + line - shown) * TEXT_SCREEN_WIDTH],
+                   console_row(line), TEXT_SCREEN_WIDTH * sizeof(uint16_t));
+        }
+        console_dirty = false;
+    }
+
+    update_cursor(console_view_offset ? TEXT_SCREEN_WIDTH * TEXT_SCREEN_HEIGHT : pos);
+}
+
+// Move the screen up one line, the old top row stays in the history
+void scroll()
+{
+    console_top++;
+    uint16_t *row = console_row(console_top + TEXT_SCREEN_HEIGHT - 1);
     for (int col = 0; col < TEXT_SCREEN_WIDTH; col++) {
-        int pos = (TEXT_SCREEN_HEIGHT - 1) * TEXT_SCREEN_WIDTH + col;
-        *(uint16_t*)(uintptr_t)(TEXT_VIDEO_MEMORY_ADDRESS + pos * 2) =
-            (uint16_t)(' ' | ((uint16_t)(VGA_COLOR_WHITE | VGA_COLOR_BLUE << 4)) << 8);
+        row[col] = vga_entry(' ');
     }
+    console_mark_dirty(console_top + TEXT_SCREEN_HEIGHT - 1, console_top + TEXT_SCREEN_HEIGHT - 1);
 }
 
 void clear()
 {
-    for (uint16_t i = 0; i < (TEXT_SCREEN_WIDTH * TEXT_SCREEN_HEIGHT); i++) {
-        *(uint16_t*)(uintptr_t)(TEXT_VIDEO_MEMORY_ADDRESS + i * 2) =
-            (uint16_t)(' ' | ((uint16_t)(VGA_COLOR_WHITE | VGA_COLOR_BLUE << 4)) << 8);
+    for (uint32_t line = console_top; line < console_top + TEXT_SCREEN_HEIGHT; line++) {
+        uint16_t *row = console_row(line);
+        for (int col = 0; col < TEXT_SCREEN_WIDTH; col++) {
+            row[col] = vga_entry(' ');
+        }
     }
+    console_mark_dirty(console_top, console_top + TEXT_SCREEN_HEIGHT - 1);
     pos = 0;
-    update_cursor(pos);
+    console_view_offset = 0;
+    console_flush();
 }
 
-void putchar(char c)
+// Scroll the view through the history, positive is further back. Any new
+// output snaps the view back to the live screen.
+void console_scroll_view(int lines)
 {
-    if (c == '\n') {
-        pos += TEXT_SCREEN_WIDTH - (pos % TEXT_SCREEN_WIDTH);
-    }
-    else if (c == '\b') { // Handle backspace
-        if (pos > 0) {
-            pos--; // Move cursor back
-            *(uint16_t*)(uintptr_t)(TEXT_VIDEO_MEMORY_ADDRESS + pos * 2) =
-                (uint16_t)(' ' | ((uint16_t)(VGA_COLOR_WHITE | VGA_COLOR_BLUE << 4)) << 8); // Replace with space
+    if (!(console_outputs & CONSOLE_VGA)) return;  // Text memory is not on screen
+
+    uint32_t flags = irq_save();
+    int32_t offset = (int32_t)console_view_offset + lines;
+    uint32_t limit = CONSOLE_HISTORY_ROWS - TEXT_SCREEN_HEIGHT;
+    if (limit > console_top) limit = console_top;
+    if (offset < 0) offset = 0;
+    if ((uint32_t)offset > limit) offset = limit;
+
+    console_view_offset = offset;
+    console_flush();
+    irq_restore(flags);
+}
+
+// Put len characters on screen. They land in the shadow buffer; video
+// memory and the hardware cursor are only touched once, after the whole run.
+void vga_write(const char *s, size_t len)
+{
+    console_view_offset = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        char c = s[i];
+        uint32_t line = console_top + pos / TEXT_SCREEN_WIDTH;
+        if (c == '\n') {
+            pos += TEXT_SCREEN_WIDTH - (pos % TEXT_SCREEN_WIDTH);
+        } else if (c == '\b') { // Handle backspace
+            if (pos > 0) {
+                pos--; // Move cursor back
+                line = console_top + pos / TEXT_SCREEN_WIDTH;
+                console_row(line)[pos % TEXT_SCREEN_WIDTH] = vga_entry(' '); // Replace with space
+                console_mark_dirty(line, line);
+            }
+        } else {
+            console_row(line)[pos % TEXT_SCREEN_WIDTH] = vga_entry(c);
+            console_mark_dirty(line, line);
+            pos++;
         }
-    } 
-     else {
-        *(uint16_t*)(uintptr_t)(TEXT_VIDEO_MEMORY_ADDRESS + pos * 2) =
-            (uint16_t)(c | ((uint16_t)(VGA_COLOR_WHITE | VGA_COLOR_BLUE << 4)) << 8);
-        pos++;
-    }
 
-    // Handle line wrapping and scrolling
-    if (pos >= TEXT_SCREEN_WIDTH * TEXT_SCREEN_HEIGHT) {
-        scroll();
-        pos -= TEXT_SCREEN_WIDTH;
+        // Handle line wrapping and scrolling
+        if (pos >= TEXT_SCREEN_WIDTH * TEXT_SCREEN_HEIGHT) {
+            scroll();
+            pos -= TEXT_SCREEN_WIDTH;
+        }
     }
 
-    update_cursor(pos);
+    console_flush();
+}
+
+// Route console output to any mix of CONSOLE_VGA, CONSOLE_SERIAL and CONSOLE_FRAMEBUFFER
+void console_set_output(uint32_t outputs)
+{
+    console_outputs = outputs;
+}
+
+// The shadow buffers, rings and cursors are updated with interrupts off, so
+// preemption or the keyboard echo never lands in the middle of another
+// writer's update. The framebuffer blit runs with interrupts on but
+// preemption off, so no other task's line gets drawn in its middle.
+void console_write(const char *s, size_t len)
+{
+    preempt_disable();
+    uint32_t flags = irq_save();
+    if (console_outputs & CONSOLE_VGA) vga_write(s, len);
+    if (console_outputs & CONSOLE_SERIAL) serial_write(s, len);
+    if (console_outputs & CONSOLE_FRAMEBUFFER) fb_write(s, len);
+    irq_restore(flags);
+    if (console_outputs & CONSOLE_FRAMEBUFFER) fb_flush();
+    preempt_enable();
+}
+
+void putchar(char c)
+{
+    console_write(&c, 1);
 }
 
 void puts(const char* s)
 {
-    for (size_t i = 0; i < strlen(s); i++) {
-        putchar(s[i]);
-    }
+    console_write(s, strlen(s));
 }
 
-void printf(const char *format, ...) {
-    va_list args;
-    va_start(args, format);
+#define CONSOLE_BUFFER_SIZE 128  // printf() output is staged here, then written in one go
 
-    char buffer[32]; // Temporary buffer for numbers
-    const char *str;
-    int num;
-    double fnum;
-
-    for (; *format != '\0'; format++) {
-        if (*format == '%') {
-            format++; // Move past '%'
-
-            switch (*format) {
-                case 's': // String
-                    str = va_arg(args, const char *);
-                    puts(str);
-                    break;
-
-                case 'd': // Decimal integer
-                case 'i': // Integer
-                    num = va_arg(args, int);
-                    itoa(num, buffer, 10);
-                    puts(buffer);
-                    break;
-
-                case 'x': // Hexadecimal
-                    num = va_arg(args, int);
-                    itoa(num, buffer, 16);
-                    puts(buffer);
-                    break;
-
-                case 'c': // Character
-                    num = va_arg(args, int);
-                    char charBuffer[2] = {(char)num, '\0'};
-                    puts(charBuffer);
-                    break;
-
-                case 'f': // Floating-point
-                    fnum = va_arg(args, double);
-                    ftoa(fnum, buffer, 10); // Default precision: 6
-                    puts(buffer);
-                    break;    
-
-                case '%': // Literal '%'
-                    puts("%");
-                    break;
-
-                default: // Unknown specifier
-                    puts("?");
-                    break;
-            }
-        } else {
-            // Print characters as-is
-            char charBuffer[2] = {*format, '\0'};
-            puts(charBuffer);
-        }
-    }
+static void console_sink_flush(format_sink_t *sink)
+{
+    console_write(sink->buf, sink->len);
+    sink->len = 0;
+}
+
+void vprintf(const char *format, va_list args)
+{
+    char buffer[CONSOLE_BUFFER_SIZE];
+    format_sink_t sink = { .buf = buffer, .size = sizeof(buffer), .flush = console_sink_flush };
+    vformat(&sink, format, args);
+    console_sink_flush(&sink);
+}
 
+void printf(const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    vprintf(format, args);
     va_end(args);
 }
 
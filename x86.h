@@ -0,0 +1,85 @@
+#ifndef X86_H
+#define X86_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Wrappers for x86 instructions (interrupt flag, CPUID, control registers,
+// MSRs) and the preemption count, kept here so headers anywhere in the
+// single translation unit can use them.
+
+// Disable interrupts, returning the old EFLAGS for irq_restore()
+static inline uint32_t irq_save() {
+    uint32_t flags;
+    __asm__ __volatile__("pushfl; popl %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+static inline void irq_restore(uint32_t flags) {
+    __asm__ __volatile__("pushl %0; popfl" : : "r"(flags) : "memory", "cc");
+}
+
+extern void sched_yield();
+
+// While preempt_count is non-zero sched_timer() doesn't switch the running
+// task out, though interrupts are still taken. A switch that came due
+// meanwhile is made by the preempt_enable() that drops the count to zero.
+static uint32_t preempt_count = 0;
+static bool preempt_pending = false;
+
+static inline void preempt_disable() {
+    preempt_count++;
+    __asm__ __volatile__("" : : : "memory");
+}
+
+static inline void preempt_enable() {
+    __asm__ __volatile__("" : : : "memory");
+    if (--preempt_count == 0 && preempt_pending) {
+        preempt_pending = false;
+        sched_yield();
+    }
+}
+
+// Function to invoke CPUID instruction (sub-leaf 0 for leaves that have them)
+static void cpuid(uint32_t eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx, uint32_t *eax_out) {
+    __asm__ (
+        "cpuid"
+        : "=a"(*eax_out), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+        : "a"(eax), "c"(0)
+    );
+}
+
+// CPUID leaf 1 EDX feature bits
+#define CPUID_EDX_PSE  (1 << 3)   // 4 MB pages
+#define CPUID_EDX_APIC (1 << 9)   // Local APIC
+#define CPUID_EDX_PGE  (1 << 13)  // Global pages
+#define CPUID_EDX_FXSR (1 << 24)  // fxsave/fxrstor
+#define CPUID_EDX_SSE2 (1 << 26)  // SSE2, including movnti
+
+// CPUID leaf 1 ECX feature bits
+#define CPUID_ECX_TSC_DEADLINE (1 << 24)  // Local APIC timer TSC-deadline mode
+
+// CPUID leaf 7 EBX feature bits
+#define CPUID7_EBX_ERMS (1 << 9)  // Enhanced rep movsb/stosb
+
+static inline uint32_t read_cr4() {
+    uint32_t value;
+    __asm__ __volatile__("movl %%cr4, %0" : "=r"(value));
+    return value;
+}
+
+static inline void write_cr4(uint32_t value) {
+    __asm__ __volatile__("movl %0, %%cr4" : : "r"(value) : "memory");
+}
+
+static inline uint64_t rdmsr(uint32_t msr) {
+    uint32_t low, high;
+    __asm__ __volatile__("rdmsr" : "=a"(low), "=d"(high) : "c"(msr));
+    return ((uint64_t)high << 32) | low;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t value) {
+    __asm__ __volatile__("wrmsr" : : "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)) : "memory");
+}
+
+#endif